@@ -0,0 +1,353 @@
+import array
+import builtins
+import sys
+import time
+
+from tap import core
+
+def measure(name, func, count, unit="objects", repeat=5):
+	best = None
+
+	for _ in range(repeat):
+		t = time.perf_counter()
+		func()
+		t = time.perf_counter() - t
+
+		if best is None or t < best:
+			best = t
+
+	print("{:<40} {:>10.0f} {}/s  ({:.3f} s)".format(name, count / best, unit, best))
+
+def loopback(sender, receiver, obj, flags=0):
+	buf = bytearray()
+	core.marshal(sender, buf, obj, flags)
+	return core.unmarshal(receiver, bytes(buf))
+
+def bench_lookup(size):
+	# Every object in the graph is already known to both peers, so resending
+	# it exercises only the peer tables: one state lookup per visited object
+	# and one key lookup per reference, in both directions.
+
+	graph = [[i, str(i), (i, i + 1)] for i in range(size)]
+	count = 1 + size * 6
+
+	local = core.Peer()
+	remote = core.Peer()
+
+	copy = loopback(local, remote, graph)
+
+	measure("resend (local keys)", lambda: loopback(local, remote, graph), count)
+	measure("resend (remote keys)", lambda: loopback(remote, local, copy), count)
+
+	def send_new():
+		loopback(core.Peer(), core.Peer(), graph)
+
+	measure("send to new peer", send_new, count)
+
+def bench_marshal(size):
+	# Large first sends, which emit a record for every object in the graph.
+
+	graphs = [
+		("ints and strings", [[i, str(i)] for i in range(size)], 1 + size * 3),
+		("bytes", [b"x" * 1000 for i in range(size // 10)], 1 + size // 10),
+	]
+
+	for name, graph, count in graphs:
+		for mode, flags in [("streaming", 0), ("presized", core.MARSHAL_PRESIZED)]:
+			def send():
+				core.marshal(core.Peer(), bytearray(), graph, flags)
+
+			measure("marshal {} ({})".format(name, mode), send, count)
+
+def bench_segments(size):
+	# Large payloads are copied to the bytearray by marshal, but only
+	# referenced by marshal_segments.
+
+	graph = [b"x" * 100000 for i in range(size // 1000)]
+	count = 1 + len(graph)
+
+	def send_copy():
+		core.marshal(core.Peer(), bytearray(), graph, core.MARSHAL_PRESIZED)
+
+	def send_segments():
+		core.marshal_segments(core.Peer(), bytearray(), graph, core.MARSHAL_PRESIZED)
+
+	measure("marshal large bytes (copy)", send_copy, count)
+	measure("marshal large bytes (segments)", send_segments, count)
+
+	graph = [array.array("d", range(12500)) for i in range(size // 1000)]
+
+	measure("marshal large arrays (copy)", send_copy, count)
+	measure("marshal large arrays (segments)", send_segments, count)
+
+def bench_views(size):
+	# Large payloads are copied out of the message by default, or referenced
+	# by memoryviews which keep it alive.
+
+	graph = [b"x" * 1000000 for i in range(size // 10000)]
+	buf = bytearray()
+	core.marshal(core.Peer(), buf, graph, core.MARSHAL_PRESIZED)
+	data = bytes(buf)
+
+	for mode, threshold in [("copy", 0), ("views", 65536)]:
+		def receive():
+			peer = core.Peer()
+			peer.view_threshold = threshold
+			core.unmarshal(peer, data)
+
+		measure("unmarshal large bytes ({})".format(mode), receive, len(data), "bytes")
+
+def bench_into(size):
+	# Small update messages, written to a new bytearray or to a reused
+	# preallocated buffer.
+
+	state = {i: i for i in range(100)}
+
+	local = core.Peer()
+	loopback(local, core.Peer(), state)
+
+	buf = bytearray(1 << 16)
+
+	def send_bytearray():
+		for i in range(size):
+			state[0] = i
+			core.marshal(local, bytearray(), state, core.MARSHAL_PRESIZED)
+
+	def send_into():
+		for i in range(size):
+			state[0] = i
+			core.marshal_into(local, buf, 0, state)
+
+	measure("send update (bytearray)", send_bytearray, size, "sends")
+	measure("send update (reused buffer)", send_into, size, "sends")
+
+def bench_incremental(size):
+	# Resending a large tree after modifying a single leaf.  A full marshal
+	# walks the whole tree; an incremental one visits only the journaled
+	# leaf.
+
+	tree = {i: [i, str(i)] for i in range(size)}
+
+	for mode, flags in [("full", 0), ("incremental", core.MARSHAL_INCREMENTAL)]:
+		local = core.Peer()
+		remote = core.Peer()
+
+		loopback(local, remote, tree, flags)
+
+		def send():
+			tree[0][0] += 1
+			loopback(local, remote, tree, flags)
+
+		measure("resend one change ({})".format(mode), send, 1, "sends")
+
+def negotiated_peers():
+	local = core.Peer()
+	remote = core.Peer()
+
+	loopback(local, remote, None, core.MARSHAL_NEGOTIATE)
+	loopback(remote, local, None, core.MARSHAL_NEGOTIATE)
+
+	return local, remote
+
+def bench_wire(size):
+	# Message size and throughput of the fixed-size wire format compared to
+	# the varint one which peers negotiate.
+
+	graph = [[i, str(i)] for i in range(size)]
+	count = 1 + size * 3
+
+	for version, peers in [(0, lambda: (core.Peer(), core.Peer())), (core.WIRE_VERSION, negotiated_peers)]:
+		local, remote = peers()
+		buf = bytearray()
+		core.marshal(local, buf, graph, core.MARSHAL_PRESIZED)
+		core.unmarshal(remote, bytes(buf))
+		print("{:<40} {:>10} bytes".format("message size (version {})".format(version), len(buf)))
+
+		def send():
+			local, remote = peers()
+			loopback(local, remote, graph, core.MARSHAL_PRESIZED)
+
+		measure("send and receive (version {})".format(version), send, count)
+
+def bench_unmarshal(size):
+	# Receiving only.  Version 0 records are read in several passes; since
+	# version 2 they are initialized as they are read, except for the ones
+	# which refer back to an object in a cycle.
+
+	cyclic = []
+
+	for i in range(size // 2):
+		item = [i, str(i)]
+		item.append(item)
+		cyclic.append(item)
+
+	graphs = [
+		("tree", [{"id": i, "name": str(i), "pair": (i, str(i))} for i in range(size // 4)], 1 + size // 4 * 4),
+		("cycles", cyclic, 1 + size // 2 * 2),
+	]
+
+	for name, graph, count in graphs:
+		for version, peers in [(0, lambda: (core.Peer(), core.Peer())), (core.WIRE_VERSION, negotiated_peers)]:
+			local, remote = peers()
+			buf = bytearray()
+			core.marshal(local, buf, graph, core.MARSHAL_PRESIZED)
+			data = bytes(buf)
+
+			def receive():
+				core.unmarshal(core.Peer(), data)
+
+			measure("unmarshal {} (version {})".format(name, version), receive, count)
+
+def bench_text(size):
+	# Strings are validated and decoded by the receiver.
+
+	graphs = [
+		("ascii", ["item {} ".format(i) * 100 for i in range(size // 10)]),
+		("latin-1", ["\xe9l\xe9ment {} ".format(i) * 100 for i in range(size // 10)]),
+		("cjk", ["\u9805\u76ee {} ".format(i) * 100 for i in range(size // 10)]),
+	]
+
+	for name, graph in graphs:
+		local, remote = negotiated_peers()
+		buf = bytearray()
+		core.marshal(local, buf, graph, core.MARSHAL_PRESIZED)
+		data = bytes(buf)
+
+		def receive():
+			core.unmarshal(core.Peer(), data)
+
+		measure("unmarshal {} strings".format(name), receive, len(data), "bytes")
+
+def bench_builtins(size):
+	# Builtin functions are resolved by module and name whenever a new peer
+	# receives them.
+
+	graph = [getattr(builtins, name) for name in ("abs", "len", "min", "max", "repr", "sorted", "sum", "print")] + [time.time, time.perf_counter, array._array_reconstructor]
+	buf = bytearray()
+	core.marshal(core.Peer(), buf, graph, core.MARSHAL_PRESIZED)
+	data = bytes(buf)
+
+	def receive():
+		for i in range(size // 100):
+			core.unmarshal(core.Peer(), data)
+
+	measure("unmarshal builtins", receive, size // 100 * len(graph))
+
+def bench_packed(size):
+	# Numeric lists, which version 1 packs into a single record.
+
+	graphs = [
+		("ints", list(range(size))),
+		("floats", [i * 0.5 for i in range(size)]),
+	]
+
+	for name, graph in graphs:
+		for version, peers in [(0, lambda: (core.Peer(), core.Peer())), (core.WIRE_VERSION, negotiated_peers)]:
+			local, remote = peers()
+			buf = bytearray()
+			core.marshal(local, buf, graph, core.MARSHAL_PRESIZED)
+			print("{:<40} {:>10} bytes".format("{} size (version {})".format(name, version), len(buf)))
+
+			def send():
+				local, remote = peers()
+				loopback(local, remote, graph, core.MARSHAL_PRESIZED)
+
+			measure("send and receive {} (version {})".format(name, version), send, size)
+
+def bench_sets(size):
+	# Sets used to be converted to lists by the caller and back by the
+	# receiver.
+
+	graph = set(str(i) for i in range(size))
+
+	def send_list():
+		local, remote = negotiated_peers()
+		set(loopback(local, remote, list(graph)))
+
+	def send_set():
+		local, remote = negotiated_peers()
+		loopback(local, remote, graph)
+
+	measure("send and receive set (as list)", send_list, size)
+	measure("send and receive set", send_set, size)
+
+class Record:
+	def __init__(self, i):
+		self.id = i
+		self.name = str(i)
+
+def bench_objects(size):
+	# Instances used to be converted to dicts by the caller and back by the
+	# receiver.
+
+	graph = [Record(i) for i in range(size // 10)]
+	count = 1 + len(graph) * 4
+
+	def send_dicts():
+		local, remote = negotiated_peers()
+		received = loopback(local, remote, [vars(record) for record in graph])
+		for attrs in received:
+			record = Record.__new__(Record)
+			record.__dict__.update(attrs)
+
+	def send_objects():
+		local, remote = negotiated_peers()
+		loopback(local, remote, graph)
+
+	measure("send and receive objects (as dicts)", send_dicts, count)
+	measure("send and receive objects", send_objects, count)
+
+def bench_hooks(size, peer_count=200):
+	# Every deallocation and every dict or list item assignment in the
+	# process passes through a hook, whether or not some peer tracks the
+	# object.
+
+	peers = []
+	shared = {}
+
+	for i in range(peer_count):
+		local = core.Peer()
+		remote = core.Peer()
+		loopback(local, remote, [shared, [[j, str(j)] for j in range(100)]])
+		peers.append((local, remote))
+
+	def churn():
+		for i in range(size):
+			str(i)
+
+	measure("free with {} peers".format(peer_count * 2), churn, size)
+
+	d = {}
+
+	def assign():
+		for i in range(size):
+			d[0] = i
+
+	measure("assign with {} peers".format(peer_count * 2), assign, size)
+
+	def assign_shared():
+		for i in range(size):
+			shared[0] = i
+
+	measure("assign to object sent to {} peers".format(peer_count), assign_shared, size)
+
+def main():
+	size = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+
+	bench_lookup(size)
+	bench_marshal(size)
+	bench_segments(size)
+	bench_views(size)
+	bench_into(size)
+	bench_incremental(size)
+	bench_wire(size)
+	bench_unmarshal(size)
+	bench_text(size)
+	bench_builtins(size)
+	bench_packed(size)
+	bench_sets(size)
+	bench_objects(size)
+	bench_hooks(size)
+
+if __name__ == "__main__":
+	main()
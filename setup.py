@@ -6,6 +6,11 @@ setup(
 	packages = [
 		"tap",
 	],
+	headers = [
+		"tap/core/api.hpp",
+		"tap/core/portable.hpp",
+		"tap/core/wire.hpp",
+	],
 	ext_modules = [
 		Extension(
 			"tap/core",
@@ -6,8 +6,7 @@ static void (*object_free_orig)(void *ctx, void *ptr) noexcept;
 
 static void object_free_wrap(void *ctx, void *ptr) noexcept
 {
-	for (PeerObject *peer: instance_peers())
-		peer->object_freed(ptr);
+	instance_index().object_freed(ptr);
 
 	object_free_orig(ctx, ptr);
 }
@@ -0,0 +1,85 @@
+#ifndef TAP_CORE_API_HPP
+#define TAP_CORE_API_HPP
+
+#include <Python.h>
+
+#include "wire.hpp"
+
+namespace tap {
+
+struct PeerObject;
+
+struct TypeHandler {
+	int32_t type_id;
+	int (*traverse)(PyObject *object, visitproc visit, void *arg) noexcept;
+	// Returns the exact size in version 0, or an upper bound.
+	Py_ssize_t (*marshaled_size)(PyObject *object, unsigned int version) noexcept;
+	int (*marshal)(PyObject *object, Writer &writer, PeerObject &peer) noexcept;
+	PyObject *(*unmarshal_alloc)(Reader &reader, PeerObject &peer) noexcept;
+	int (*unmarshal_init)(PyObject *object, Reader &reader, PeerObject &peer) noexcept;
+	int (*unmarshal_update)(PyObject *object, Reader &reader, PeerObject &peer) noexcept;
+
+	// Optional: returns the size of the object memory which marshal passes
+	// to Writer::payload, so that it can be referenced instead of copied.
+	Py_ssize_t (*payload)(PyObject *object) noexcept;
+
+	// Optional: tells if the object's items are stored by value in its
+	// record, so that they needn't be traversed.
+	bool (*by_value)(PyObject *object, unsigned int version) noexcept;
+};
+
+/*
+ * C API for extension modules which marshal their own types natively.  It is
+ * exported by tap.core as a capsule; see api_import.  Type ids from
+ * TYPE_ID_EXTENSION_BASE up are reserved for extension handlers, and both
+ * peers must register the same handler under the same type id.
+ */
+enum {
+	API_VERSION = 1,
+	TYPE_ID_EXTENSION_BASE = 0x100,
+	TYPE_ID_LIMIT = 0x10000,
+};
+
+#define TAP_CORE_API_CAPSULE "tap.core._api"
+
+struct API {
+	int version;
+
+	// Maps objects of the exact type to the handler.  Fails with an
+	// exception if the type or the type id is already registered.  The
+	// type is referenced for good; the handler must stay valid too.
+	int (*register_type)(PyTypeObject *type, const TypeHandler *handler) noexcept;
+
+	// Returns a key for writing a reference, or -1.
+	Key (*key_for_remote)(PeerObject &peer, PyObject *object) noexcept;
+
+	// Returns a borrowed reference to the object of a key read from a
+	// record, or nullptr.
+	PyObject *(*object)(PeerObject &peer, Key key) noexcept;
+
+	// Marks a modified object, so that it is sent again.
+	void (*touch)(PyObject *object) noexcept;
+};
+
+// Returns nullptr with an exception set if tap.core can't be imported or its
+// API version differs.
+inline const API *api_import() noexcept
+{
+	PyObject *module = PyImport_ImportModule("tap.core");
+	if (module == nullptr)
+		return nullptr;
+
+	Py_DECREF(module);
+
+	auto api = reinterpret_cast<const API *> (PyCapsule_Import(TAP_CORE_API_CAPSULE, 0));
+	if (api && api->version != API_VERSION) {
+		PyErr_SetString(PyExc_ImportError, "tap.core API version mismatch");
+		return nullptr;
+	}
+
+	return api;
+}
+
+} // namespace tap
+
+#endif
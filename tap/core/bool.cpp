@@ -8,26 +8,28 @@ static int bool_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t bool_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t bool_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	return sizeof (uint8_t);
 }
 
-static int bool_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int bool_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
-	*reinterpret_cast<uint8_t *> (buf) = port(object != Py_False);
+	writer.uint8(object != Py_False);
 	return 0;
 }
 
-static PyObject *bool_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *bool_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size != sizeof (uint8_t))
+	uint8_t value;
+
+	if (!reader.uint8(&value) || !reader.at_end())
 		return nullptr;
 
-	return PyBool_FromLong(port(*reinterpret_cast<const uint8_t *> (data)));
+	return PyBool_FromLong(value);
 }
 
-static int bool_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int bool_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -0,0 +1,376 @@
+#include "core.hpp"
+#include "mapping.hpp"
+
+#include <cstring>
+
+namespace tap {
+
+enum BufferKind {
+	BUFFER_BYTEARRAY,
+	BUFFER_MEMORYVIEW,
+	BUFFER_ARRAY,
+};
+
+struct ArrayTag;
+
+static PyTypeObject *array_type;
+
+// Contents of a record: kind, readonly flag, format, shape and C-contiguous
+// data.
+struct BufferInfo {
+	uint8_t kind;
+	uint8_t readonly;
+	char format[256];
+	uint8_t ndim;
+	Py_ssize_t shape[PyBUF_MAX_NDIM];
+	const void *data;
+	Py_ssize_t size;
+};
+
+int buffer_type_init() noexcept
+{
+	PyObject *module = PyImport_ImportModule("array");
+	if (module == nullptr)
+		return -1;
+
+	array_type = reinterpret_cast<PyTypeObject *> (PyObject_GetAttrString(module, "array"));
+	Py_DECREF(module);
+
+	if (array_type == nullptr)
+		return -1;
+
+	if (!PyType_Check(array_type) || array_type->tp_as_mapping == nullptr) {
+		Py_CLEAR(array_type);
+		return -1;
+	}
+
+	MappingWrap<PyByteArrayObject>::init(&PyByteArray_Type);
+	MappingWrap<PyMemoryViewObject>::init(&PyMemoryView_Type);
+	MappingWrap<ArrayTag>::init(array_type);
+
+	if (type_register(&PyByteArray_Type, &buffer_type_handler) < 0 ||
+	    type_register(&PyMemoryView_Type, &buffer_type_handler) < 0 ||
+	    type_register(array_type, &buffer_type_handler) < 0)
+		return -1;
+
+	return 0;
+}
+
+static BufferKind buffer_kind(PyObject *object) noexcept
+{
+	if (Py_TYPE(object) == &PyByteArray_Type)
+		return BUFFER_BYTEARRAY;
+
+	if (Py_TYPE(object) == &PyMemoryView_Type)
+		return BUFFER_MEMORYVIEW;
+
+	return BUFFER_ARRAY;
+}
+
+static const char *buffer_format(const Py_buffer &view) noexcept
+{
+	return view.format ? view.format : "B";
+}
+
+// Memoryviews can be cast only to native single-character formats.
+static bool buffer_native_format(const char *format) noexcept
+{
+	if (format[0] == '@')
+		format++;
+
+	return format[0] != '\0' && format[1] == '\0' && strchr("?cbBhHiIlLqQnNfdP", format[0]);
+}
+
+// Format and shape of a record.  The contents of memoryviews with other
+// formats are sent as unsigned bytes, with the items of the last dimension
+// split into bytes.
+struct BufferShape {
+	const char *format;
+	int ndim;
+	Py_ssize_t shape[PyBUF_MAX_NDIM];
+};
+
+static void buffer_shape(PyObject *object, const Py_buffer &view, BufferShape *shape) noexcept
+{
+	shape->format = buffer_format(view);
+	shape->ndim = view.ndim;
+
+	for (int i = 0; i < view.ndim; i++)
+		shape->shape[i] = view.shape[i];
+
+	if (buffer_kind(object) != BUFFER_MEMORYVIEW || buffer_native_format(shape->format))
+		return;
+
+	shape->format = "B";
+
+	if (shape->ndim == 0) {
+		shape->ndim = 1;
+		shape->shape[0] = view.itemsize;
+	} else {
+		shape->shape[shape->ndim - 1] *= view.itemsize;
+	}
+}
+
+static int buffer_traverse(PyObject *object, visitproc visit, void *arg) noexcept
+{
+	return 0;
+}
+
+static Py_ssize_t buffer_marshaled_size(PyObject *object, unsigned int version) noexcept
+{
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(object, &view, PyBUF_FULL_RO) < 0)
+		return -1;
+
+	BufferShape shape;
+	buffer_shape(object, view, &shape);
+
+	Py_ssize_t size = 4 + strlen(shape.format) + wire_int64_size(version) * shape.ndim + view.len;
+
+	PyBuffer_Release(&view);
+
+	return size;
+}
+
+static int buffer_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(object, &view, PyBUF_FULL_RO) < 0)
+		return -1;
+
+	int ret = -1;
+	BufferShape shape;
+	buffer_shape(object, view, &shape);
+	size_t format_len = strlen(shape.format);
+
+	writer.uint8(buffer_kind(object));
+	writer.uint8(view.readonly);
+	writer.uint8(format_len);
+	writer.data(shape.format, format_len);
+	writer.uint8(shape.ndim);
+
+	for (int i = 0; i < shape.ndim; i++)
+		writer.int64(shape.shape[i]);
+
+	if (PyBuffer_IsContiguous(&view, 'C')) {
+		writer.payload(view.buf, view.len);
+		ret = 0;
+	} else {
+		PyObject *copy = PyMemoryView_GetContiguous(object, PyBUF_READ, 'C');
+		if (copy) {
+			Py_buffer *copy_view = PyMemoryView_GET_BUFFER(copy);
+			writer.data(copy_view->buf, copy_view->len);
+			Py_DECREF(copy);
+			ret = 0;
+		}
+	}
+
+	PyBuffer_Release(&view);
+
+	return ret;
+}
+
+// Only contiguous memory can be referenced.
+static Py_ssize_t buffer_payload(PyObject *object) noexcept
+{
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(object, &view, PyBUF_FULL_RO) < 0) {
+		PyErr_Clear();
+		return 0;
+	}
+
+	Py_ssize_t size = PyBuffer_IsContiguous(&view, 'C') ? view.len : 0;
+
+	PyBuffer_Release(&view);
+
+	return size;
+}
+
+static bool buffer_read(Reader &reader, BufferInfo *info) noexcept
+{
+	uint8_t format_len;
+
+	if (!reader.uint8(&info->kind) || info->kind > BUFFER_ARRAY ||
+	    !reader.uint8(&info->readonly) ||
+	    !reader.uint8(&format_len))
+		return false;
+
+	const void *format = reader.data(format_len);
+	if (format == nullptr || memchr(format, '\0', format_len))
+		return false;
+
+	memcpy(info->format, format, format_len);
+	info->format[format_len] = '\0';
+
+	if (!reader.uint8(&info->ndim) || info->ndim > PyBUF_MAX_NDIM)
+		return false;
+
+	for (int i = 0; i < info->ndim; i++) {
+		int64_t dim;
+
+		if (!reader.int64(&dim) || dim < 0 || dim > PY_SSIZE_T_MAX)
+			return false;
+
+		info->shape[i] = dim;
+	}
+
+	info->size = reader.remaining();
+	info->data = reader.data(info->size);
+	return true;
+}
+
+static int array_extend(PyObject *array, const BufferInfo &info) noexcept
+{
+	PyObject *memoryview = PyMemoryView_FromMemory(reinterpret_cast<char *> (const_cast<void *> (info.data)), info.size, PyBUF_READ);
+	if (memoryview == nullptr)
+		return -1;
+
+	PyObject *result = PyObject_CallMethod(array, "frombytes", "O", memoryview);
+	Py_DECREF(memoryview);
+
+	if (result == nullptr)
+		return -1;
+
+	Py_DECREF(result);
+	return 0;
+}
+
+static PyObject *memoryview_create(const BufferInfo &info) noexcept
+{
+	const char *data = reinterpret_cast<const char *> (info.data);
+	PyObject *base;
+
+	if (info.readonly)
+		base = PyBytes_FromStringAndSize(data, info.size);
+	else
+		base = PyByteArray_FromStringAndSize(data, info.size);
+
+	if (base == nullptr)
+		return nullptr;
+
+	PyObject *memoryview = PyMemoryView_FromObject(base);
+	Py_DECREF(base);
+
+	if (memoryview == nullptr || (info.ndim == 1 && strcmp(info.format, "B") == 0))
+		return memoryview;
+
+	PyObject *shape = PyTuple_New(info.ndim);
+	if (shape == nullptr) {
+		Py_DECREF(memoryview);
+		return nullptr;
+	}
+
+	for (int i = 0; i < info.ndim; i++) {
+		PyObject *dim = PyLong_FromSsize_t(info.shape[i]);
+		if (dim == nullptr) {
+			Py_DECREF(shape);
+			Py_DECREF(memoryview);
+			return nullptr;
+		}
+
+		PyTuple_SET_ITEM(shape, i, dim);
+	}
+
+	PyObject *cast = PyObject_CallMethod(memoryview, "cast", "sO", info.format, shape);
+	Py_DECREF(shape);
+	Py_DECREF(memoryview);
+
+	return cast;
+}
+
+static PyObject *buffer_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	BufferInfo info;
+
+	if (!buffer_read(reader, &info))
+		return nullptr;
+
+	switch (BufferKind(info.kind)) {
+	case BUFFER_BYTEARRAY:
+		return PyByteArray_FromStringAndSize(reinterpret_cast<const char *> (info.data), info.size);
+
+	case BUFFER_MEMORYVIEW:
+		return memoryview_create(info);
+
+	case BUFFER_ARRAY:
+		{
+			PyObject *array = PyObject_CallFunction(reinterpret_cast<PyObject *> (array_type), "s", info.format);
+			if (array && array_extend(array, info) < 0)
+				Py_CLEAR(array);
+
+			return array;
+		}
+	}
+
+	return nullptr;
+}
+
+static int buffer_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	return 0;
+}
+
+// Overwrites the contents in place if the size is unchanged; bytearrays and
+// arrays may also be resized.
+static int buffer_unmarshal_update(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	BufferInfo info;
+
+	if (!buffer_read(reader, &info) || info.kind != buffer_kind(object))
+		return -1;
+
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(object, &view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+		return -1;
+
+	bool same_format = strcmp(buffer_format(view), info.format) == 0;
+	bool same_size = view.len == info.size;
+
+	if (same_format && same_size)
+		memcpy(view.buf, info.data, info.size);
+
+	PyBuffer_Release(&view);
+
+	if (!same_format)
+		return -1;
+
+	if (same_size)
+		return 0;
+
+	switch (BufferKind(info.kind)) {
+	case BUFFER_BYTEARRAY:
+		if (PyByteArray_Resize(object, info.size) < 0)
+			return -1;
+
+		memcpy(PyByteArray_AS_STRING(object), info.data, info.size);
+		return 0;
+
+	case BUFFER_ARRAY:
+		if (PySequence_DelSlice(object, 0, PY_SSIZE_T_MAX) < 0)
+			return -1;
+
+		return array_extend(object, info);
+
+	case BUFFER_MEMORYVIEW:
+		break;
+	}
+
+	return -1;
+}
+
+const TypeHandler buffer_type_handler = {
+	BUFFER_TYPE_ID,
+	buffer_traverse,
+	buffer_marshaled_size,
+	buffer_marshal,
+	buffer_unmarshal_alloc,
+	buffer_unmarshal_init,
+	buffer_unmarshal_update,
+	buffer_payload,
+};
+
+} // namespace tap
@@ -22,7 +22,7 @@ static int builtin_traverse(PyObject *object, visitproc visit, void *arg) noexce
 	return 0;
 }
 
-static Py_ssize_t builtin_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t builtin_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	PyCFunctionObject *builtin = reinterpret_cast<PyCFunctionObject *> (object);
 
@@ -36,26 +36,83 @@ static Py_ssize_t builtin_marshaled_size(PyObject *object) noexcept
 	return strlen(module) + 1 + strlen(builtin->m_ml->ml_name) + 1;
 }
 
-static int builtin_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int builtin_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	PyCFunctionObject *builtin = reinterpret_cast<PyCFunctionObject *> (object);
-	char *portable = reinterpret_cast<char *> (buf);
 
 	const char *module = reinterpret_cast<const char *> (PyUnicode_DATA(builtin->m_module));
-	auto modulesize = strlen(module) + 1;
+	const char *name = builtin->m_ml->ml_name;
 
-	memcpy(portable, module, modulesize);
-	strcpy(portable + modulesize, builtin->m_ml->ml_name);
+	writer.data(module, strlen(module) + 1);
+	writer.data(name, strlen(name) + 1);
 
 	return 0;
 }
 
-static PyObject *builtin_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *builtin_resolve(const char *module, const char *name, BuiltinResolution *resolution) noexcept
 {
+	PyObject *module_name = PyUnicode_InternFromString(module);
+	if (module_name == nullptr)
+		return nullptr;
+
+	PyObject *mod = PyImport_Import(module_name);
+	if (mod == nullptr) {
+		fprintf(stderr, "tap builtin unmarshal: failed to import module %s\n", module);
+		Py_DECREF(module_name);
+		return nullptr;
+	}
+
+	PyObject *object = PyDict_GetItemString(PyModule_GetDict(mod), name);
+	if (object == nullptr) {
+		Py_DECREF(mod);
+		Py_DECREF(module_name);
+		return nullptr;
+	}
+
+	Py_INCREF(object);
+
+	resolution->module_name = module_name;
+	resolution->module = mod;
+	resolution->object = object;
+	return object;
+}
+
+static void builtin_release(BuiltinResolution &resolution) noexcept
+{
+	Py_DECREF(resolution.object);
+	Py_DECREF(resolution.module);
+	Py_DECREF(resolution.module_name);
+}
+
+// Resolutions are cached by a hash of the raw payload, so that a lookup
+// doesn't allocate.  The payload has been validated when the entry was added.
+// An entry is replaced if its module has been replaced or if another payload
+// has the same hash.
+static PyObject *builtin_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t size = reader.remaining();
 	if (size < 4)
 		return nullptr;
 
-	const char *portable = reinterpret_cast<const char *> (data);
+	const char *portable = reinterpret_cast<const char *> (reader.data(size));
+	Py_hash_t hash = _Py_HashBytes(portable, size);
+	auto &cache = instance_builtins();
+	auto entry = cache.find(hash);
+
+	if (entry != cache.end()) {
+		BuiltinResolution &resolution = entry->second;
+
+		if (resolution.payload.size() == size_t(size) &&
+		    memcmp(resolution.payload.data(), portable, size) == 0 &&
+		    PyDict_GetItem(PyImport_GetModuleDict(), resolution.module_name) == resolution.module) {
+			Py_INCREF(resolution.object);
+			return resolution.object;
+		}
+
+		builtin_release(resolution);
+		cache.erase(entry);
+	}
+
 	if (portable[size - 1] != '\0')
 		return nullptr;
 
@@ -78,23 +135,25 @@ static PyObject *builtin_unmarshal_alloc(const void *data, Py_ssize_t size, Peer
 		return nullptr;
 	}
 
-	PyObject *mod = PyImport_ImportModule(module);
-	if (mod == nullptr) {
-		fprintf(stderr, "tap builtin unmarshal: failed to import module %s\n", module);
-		return nullptr;
-	}
+	BuiltinResolution resolution;
 
-	PyObject *object = PyDict_GetItemString(PyModule_GetDict(mod), name);
+	PyObject *object = builtin_resolve(module, name, &resolution);
 	if (object == nullptr)
 		return nullptr;
 
 	Py_INCREF(object);
-	Py_DECREF(mod);
+
+	try {
+		resolution.payload.assign(portable, size);
+		cache.insert(std::make_pair(hash, std::move(resolution)));
+	} catch (...) {
+		builtin_release(resolution);
+	}
 
 	return object;
 }
 
-static int builtin_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int builtin_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -9,25 +9,42 @@ static int bytes_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t bytes_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t bytes_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	return PyBytes_GET_SIZE(object);
 }
 
-static int bytes_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int bytes_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
-	memcpy(buf, PyBytes_AS_STRING(object), size);
+	writer.payload(PyBytes_AS_STRING(object), PyBytes_GET_SIZE(object));
 	return 0;
 }
 
-static PyObject *bytes_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static Py_ssize_t bytes_payload(PyObject *object) noexcept
 {
+	return PyBytes_GET_SIZE(object);
+}
+
+// Large payloads may be received as read-only views which keep the whole
+// message alive instead of being copied, if the peer has opted in.
+static PyObject *bytes_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t size = reader.remaining();
+
+	if (peer.view_threshold > 0 && size >= peer.view_threshold && peer.unmarshal_owner)
+		return view_memoryview(peer.unmarshal_owner, reader.data(size), size);
+
 	return PyBytes_FromStringAndSize(nullptr, size);
 }
 
-static int bytes_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int bytes_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	memcpy(PyBytes_AS_STRING(object), data, size);
+	Py_ssize_t size = reader.remaining();
+
+	if (!PyBytes_CheckExact(object))
+		return 0;  // view
+
+	memcpy(PyBytes_AS_STRING(object), reader.data(size), size);
 	return 0;
 }
 
@@ -38,6 +55,8 @@ const TypeHandler bytes_type_handler = {
 	bytes_marshal,
 	bytes_unmarshal_alloc,
 	bytes_unmarshal_init,
+	nullptr,
+	bytes_payload,
 };
 
 } // namespace tap
@@ -1,10 +1,10 @@
 #include "core.hpp"
-#include "portable.hpp"
 
 #include <cstring>
 
 namespace tap {
 
+// Fixed fields in wire order; cell2arg follows them.
 struct Portable {
 	int32_t argcount;
 	int32_t kwonlyargcount;
@@ -21,17 +21,26 @@ struct Portable {
 	Key name;
 	int32_t firstlineno;
 	Key lnotab;
+};
 
-	const uint8_t *cell2arg() const noexcept
-	{
-		return reinterpret_cast<const uint8_t *> (this + 1);
-	}
-
-	uint8_t *cell2arg() noexcept
-	{
-		return reinterpret_cast<uint8_t *> (this + 1);
-	}
-} TAP_PACKED;
+static bool code_read(Reader &reader, Portable *portable) noexcept
+{
+	return reader.int32(&portable->argcount) &&
+	       reader.int32(&portable->kwonlyargcount) &&
+	       reader.int32(&portable->nlocals) &&
+	       reader.int32(&portable->stacksize) &&
+	       reader.int32(&portable->flags) &&
+	       reader.key(&portable->code) &&
+	       reader.key(&portable->consts) &&
+	       reader.key(&portable->names) &&
+	       reader.key(&portable->varnames) &&
+	       reader.key(&portable->freevars) &&
+	       reader.key(&portable->cellvars) &&
+	       reader.key(&portable->filename) &&
+	       reader.key(&portable->name) &&
+	       reader.int32(&portable->firstlineno) &&
+	       reader.key(&portable->lnotab);
+}
 
 static int code_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
@@ -51,10 +60,10 @@ static int code_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t code_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t code_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	const PyCodeObject *codeobject = reinterpret_cast<PyCodeObject *> (object);
-	Py_ssize_t size = sizeof (Portable);
+	Py_ssize_t size = wire_int32_size(version) * 6 + wire_key_size(version) * 9;
 
 	if (codeobject->co_cell2arg)
 		size += PyTuple_GET_SIZE(codeobject->co_cellvars);
@@ -67,16 +76,15 @@ static Py_ssize_t code_marshaled_size(PyObject *object) noexcept
 		Key remote_key = peer.key_for_remote(codeobject->co_##NAME); \
 		if (remote_key < 0) \
 			return -1; \
-		portable->NAME = port(remote_key); \
+		writer.key(remote_key); \
 	} while (0)
 
 #define TAP_CODE_MARSHAL_VALUE(NAME) \
-	portable->NAME = port(codeobject->co_##NAME)
+	writer.int32(codeobject->co_##NAME)
 
-static int code_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int code_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	const PyCodeObject *codeobject = reinterpret_cast<PyCodeObject *> (object);
-	Portable *portable = reinterpret_cast<Portable *> (buf);
 
 	TAP_CODE_MARSHAL_VALUE(argcount);
 	TAP_CODE_MARSHAL_VALUE(kwonlyargcount);
@@ -95,7 +103,7 @@ static int code_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject
 	TAP_CODE_MARSHAL_OBJECT(lnotab);
 
 	if (codeobject->co_cell2arg)
-		memcpy(portable->cell2arg(), codeobject->co_cell2arg, PyTuple_GET_SIZE(codeobject->co_cellvars));
+		writer.data(codeobject->co_cell2arg, PyTuple_GET_SIZE(codeobject->co_cellvars));
 
 	return 0;
 }
@@ -103,27 +111,32 @@ static int code_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject
 #undef TAP_CODE_MARSHAL_OBJECT
 #undef TAP_CODE_MARSHAL_VALUE
 
-static PyObject *code_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *code_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size < Py_ssize_t(sizeof (Portable)))
+	Portable portable;
+
+	if (!code_read(reader, &portable))
 		return nullptr;
 
 	return reinterpret_cast<PyObject *> (PyObject_NEW(PyCodeObject, &PyCode_Type));
 }
 
 #define TAP_CODE_UNMARSHAL_KEY(NAME) \
-	codeobject->co_##NAME = peer.object(port(portable->NAME)); \
+	codeobject->co_##NAME = peer.object(portable.NAME); \
 	if (codeobject->co_##NAME == nullptr) \
 		return -1; \
 	Py_INCREF(codeobject->co_##NAME)
 
 #define TAP_CODE_UNMARSHAL_VALUE(NAME) \
-	codeobject->co_##NAME = port(portable->NAME)
+	codeobject->co_##NAME = portable.NAME
 
-static int code_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int code_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	PyCodeObject *codeobject = reinterpret_cast<PyCodeObject *> (object);
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
+	Portable portable;
+
+	if (!code_read(reader, &portable))
+		return -1;
 
 	TAP_CODE_UNMARSHAL_VALUE(argcount);
 	TAP_CODE_UNMARSHAL_VALUE(kwonlyargcount);
@@ -159,7 +172,7 @@ static int code_unmarshal_init(PyObject *object, const void *data, Py_ssize_t si
 		return -1;
 	}
 
-	Py_ssize_t cell2arg_size = Py_ssize_t(size) - Py_ssize_t(sizeof (Portable));
+	Py_ssize_t cell2arg_size = reader.remaining();
 	if (cell2arg_size > 0) {
 		if (cell2arg_size != PyTuple_GET_SIZE(codeobject->co_cellvars))
 			return -1;
@@ -168,7 +181,7 @@ static int code_unmarshal_init(PyObject *object, const void *data, Py_ssize_t si
 		if (codeobject->co_cell2arg == nullptr)
 			return -1;
 
-		memcpy(codeobject->co_cell2arg, portable->cell2arg(), cell2arg_size);
+		memcpy(codeobject->co_cell2arg, reader.data(cell2arg_size), cell2arg_size);
 	}
 
 	return 0;
@@ -5,16 +5,16 @@
 #include <frameobject.h>
 
 #include <cstdint>
-#include <map>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
-namespace tap {
+#include "api.hpp"
+#include "table.hpp"
+#include "wire.hpp"
 
-typedef int64_t Key;
+namespace tap {
 
 enum TypeId {
 	OPAQUE_TYPE_ID,
@@ -33,27 +33,85 @@ enum TypeId {
 	BUILTIN_TYPE_ID,
 	FRAME_TYPE_ID,
 	GEN_TYPE_ID,
+	FLOAT_TYPE_ID,
+	BUFFER_TYPE_ID,
+	SET_TYPE_ID,
+	FROZENSET_TYPE_ID,
+	OBJECT_TYPE_ID,
 
 	TYPE_ID_COUNT
 };
 
+enum MarshalFlags {
+	MARSHAL_PRESIZED    = 1 << 0,
+	MARSHAL_INCREMENTAL = 1 << 1,
+	MARSHAL_NEGOTIATE   = 1 << 2,
+};
+
+struct RecordHeader {
+	int32_t type_id;
+	Key key;
+	const void *data;
+	Py_ssize_t size;
+	bool deferred;  // always in versions before dependency order
+};
+
+// A record which is being unmarshaled.
+struct UnmarshalRecord {
+	RecordHeader header;
+	const TypeHandler *handler;
+	PyObject *object;
+	bool created;
+};
+
 struct PeerObject {
 	PyObject_HEAD
 
 	PeerObject();
 	~PeerObject();
 
-	int insert(PyObject *object, Key key) noexcept;
+	int insert_received(PyObject *object, Key key, Py_ssize_t new_ids) noexcept;
 	void clear(PyObject *object) noexcept;
-	std::pair<Key, bool> insert_or_clear_for_remote(PyObject *object) noexcept;
+	void begin_traversal() noexcept;
+	int visit_for_remote(PyObject *object, Key *remote_key, bool *changed, uint32_t *mark) noexcept;
+	void set_traversal_mark(PyObject *object, uint32_t mark) noexcept;
 	Key key_for_remote(PyObject *object) noexcept;
 	PyObject *object(Key key) noexcept;
-	void touch(PyObject *object) noexcept;
-	void set_references(const std::unordered_set<PyObject *> &referenced) noexcept;
+	void set_references(const std::vector<PyObject *> &referenced) noexcept;
 	void dereference(Key key) noexcept;
-	void object_freed(void *ptr) noexcept;
+	void mark_unsent(PyObject *object) noexcept;
+	void object_freed(PyObject *object) noexcept;
+	void release_immediates() noexcept;
+
+	bool journaling() const noexcept
+	{
+		return journal_epoch != 0;
+	}
+
+	int push_journal(std::vector<PyObject *> &stack) noexcept;
+	void reset_journal() noexcept;
+
+	// Called by the object index before the object's modification epoch is
+	// advanced; the object is journaled unless it already was.
+	void object_touched(PyObject *object, uint64_t modified) noexcept
+	{
+		if (modified <= journal_epoch)
+			journal_object(object);
+	}
 
 	std::vector<Key> freed;
+	std::vector<PyObject *> traversal_stack;
+
+	// Memory which unmarshal reuses between messages.
+	std::vector<PyObject *> unmarshal_created;
+	std::vector<UnmarshalRecord> unmarshal_deferred;
+	unsigned int wire_version;  // used for sending
+	bool version_offered;
+
+	// Received bytes of at least this size become read-only memoryviews of
+	// the message instead of copies; zero disables.
+	Py_ssize_t view_threshold;
+	PyObject *unmarshal_owner;  // owner of the message being unmarshaled
 
 private:
 	struct State;
@@ -61,49 +119,143 @@ private:
 	PeerObject(const PeerObject &);
 	void operator=(const PeerObject &);
 
-	int insert(PyObject *object, Key key, unsigned int flags) noexcept;
-	Key insert_new(PyObject *object, unsigned int flags) noexcept;
+	int insert(PyObject *object, Key key, uint64_t sent_epoch) noexcept;
+	Key insert_new(PyObject *object, uint64_t sent_epoch) noexcept;
 	Key key_for_remote(Key key) noexcept;
+	PyObject **object_slot(Key key) noexcept;
+	PyObject *immediate_object(Key key) noexcept;
+	void journal_object(PyObject *object) noexcept;
 
-	std::map<void *, State> states;
-	std::map<Key, PyObject *> objects;
+	PointerTable<State> states;
+	std::vector<PyObject *> objects[2];
 	uint32_t next_object_id;
+	uint32_t traversal;
+	std::vector<PyObject *> journal;  // objects modified since journal_epoch
+	uint64_t journal_epoch;           // zero when not journaling
+	std::vector<PyObject *> immediates;  // created during unmarshal
 };
 
-struct TypeHandler {
-	int32_t type_id;
-	int (*traverse)(PyObject *object, visitproc visit, void *arg) noexcept;
-	Py_ssize_t (*marshaled_size)(PyObject *object) noexcept;
-	int (*marshal)(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept;
-	PyObject *(*unmarshal_alloc)(const void *marshal_data, Py_ssize_t marshal_size, PeerObject &peer) noexcept;
-	int (*unmarshal_init)(PyObject *object, const void *marshal_data, Py_ssize_t marshal_size, PeerObject &peer) noexcept;
-	int (*unmarshal_update)(PyObject *object, const void *marshal_data, Py_ssize_t marshal_size, PeerObject &peer) noexcept;
+class ObjectIndex {
+public:
+	ObjectIndex() noexcept;
+	~ObjectIndex() noexcept;
+
+	int32_t subscribe(PyObject *object, PeerObject *peer) noexcept;
+	void unsubscribe(PyObject *object, PeerObject *peer) noexcept;
+	void touch(PyObject *object) noexcept;
+	void object_freed(void *ptr) noexcept;
+
+	uint64_t epoch() const noexcept
+	{
+		return current_epoch;
+	}
+
+	// Starts a journaling period at the current epoch.
+	uint64_t begin_journal() noexcept
+	{
+		return journal_epoch = current_epoch;
+	}
+
+	uint64_t modified(int32_t id) const noexcept
+	{
+		return entries[id].epoch;
+	}
+
+private:
+	struct Entry {
+		PeerObject *peer;
+		std::vector<PeerObject *> *other_peers;
+		uint64_t epoch;
+	};
+
+	ObjectIndex(const ObjectIndex &);
+	void operator=(const ObjectIndex &);
+
+	void release(void *ptr, int32_t id) noexcept;
+
+	PointerTable<int32_t> ids;
+	std::vector<Entry> entries;
+	std::vector<int32_t> free_ids;
+	uint64_t current_epoch;
+	uint64_t journal_epoch;  // latest epoch at which any peer began journaling
+	uintptr_t low;
+	uintptr_t high;
+};
+
+// The type which is allocated for records of a type id.
+struct TypeRegistration {
+	PyTypeObject *type;
+	const TypeHandler *handler;
+};
+
+// A builtin function resolved by module and name.  It is valid for as long
+// as the module is the one in sys.modules.
+struct BuiltinResolution {
+	std::string payload;  // of the record
+	PyObject *module_name;
+	PyObject *module;
+	PyObject *object;
+};
+
+// Item layouts of list and tuple records in wire version 1.
+enum SequenceLayout {
+	SEQUENCE_REFERENCES,
+	SEQUENCE_INT64,
+	SEQUENCE_FLOAT64,
 };
 
 int instance_init() noexcept;
-std::unordered_set<PeerObject *> &instance_peers() noexcept;
+ObjectIndex &instance_index() noexcept;
 std::unordered_map<std::string, PyTypeObject *> &instance_opaque_types() noexcept;
+PointerTable<const TypeHandler *> &instance_type_handlers() noexcept;
+std::vector<TypeRegistration> &instance_type_registrations() noexcept;
+PointerTable<setattrofunc> &instance_object_setattros() noexcept;
+std::unordered_map<Py_hash_t, BuiltinResolution> &instance_builtins() noexcept;
 
 void allocator_init() noexcept;
 
 int peer_type_init() noexcept;
 void peers_touch(PyObject *object) noexcept;
 
+int view_type_init() noexcept;
+PyObject *view_memoryview(PyObject *owner, const void *data, Py_ssize_t size) noexcept;
+
 PyTypeObject *opaque_type_for_name(const std::string &name) noexcept;
+bool opaque_type_check(PyTypeObject *type) noexcept;
+
+bool object_check(PyTypeObject *type) noexcept;
+PyObject *object_class_name(PyTypeObject *type) noexcept;
+PyTypeObject *object_class_for_name(const char *data, Py_ssize_t size) noexcept;
 
 void list_py_type_init() noexcept;
 
 void dict_py_type_init() noexcept;
 
+void set_py_type_init() noexcept;
+
+void unicode_init() noexcept;
+bool unicode_scan_utf8(const void *data, Py_ssize_t size, Py_ssize_t *length, Py_UCS4 *max_char) noexcept;
 bool unicode_verify_utf8(const void *data, Py_ssize_t size) noexcept;
 
 bool builtin_check(PyObject *object) noexcept;
 
+int buffer_type_init() noexcept;
+
+SequenceLayout sequence_layout(PyObject *const *items, Py_ssize_t length, unsigned int version) noexcept;
+Py_ssize_t sequence_marshaled_size(PyObject *const *items, Py_ssize_t length, unsigned int version) noexcept;
+int sequence_marshal(PyObject *const *items, Py_ssize_t length, Writer &writer, PeerObject &peer) noexcept;
+bool sequence_read_header(Reader &reader, SequenceLayout *layout, Py_ssize_t *length) noexcept;
+int sequence_unmarshal_items(Reader &reader, SequenceLayout layout, PyObject **items, Py_ssize_t length, PeerObject &peer) noexcept;
+
+int type_init() noexcept;
+int type_register(PyTypeObject *type, const TypeHandler *handler) noexcept;
 const TypeHandler *type_handler_for_object(PyObject *object) noexcept;
 const TypeHandler *type_handler_for_id(int32_t type_id) noexcept;
 
-int marshal(PeerObject &peer, PyObject *bytearray, PyObject *object) noexcept;
-PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size) noexcept;
+int marshal(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags) noexcept;
+Py_ssize_t marshal_into(PeerObject &peer, void *buf, Py_ssize_t size, PyObject *object, unsigned int flags) noexcept;
+PyObject *marshal_segments(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags, Py_ssize_t threshold) noexcept;
+PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size, PyObject *owner = nullptr) noexcept;
 
 extern PyTypeObject peer_type;
 
@@ -123,6 +275,11 @@ extern const TypeHandler module_type_handler;
 extern const TypeHandler builtin_type_handler;
 extern const TypeHandler frame_type_handler;
 extern const TypeHandler gen_type_handler;
+extern const TypeHandler float_type_handler;
+extern const TypeHandler buffer_type_handler;
+extern const TypeHandler set_type_handler;
+extern const TypeHandler frozenset_type_handler;
+extern const TypeHandler object_type_handler;
 
 } // namespace tap
 
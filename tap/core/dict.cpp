@@ -12,11 +12,6 @@ void dict_py_type_init() noexcept
 	MappingWrap<PyDictObject>::init(&PyDict_Type);
 }
 
-struct Item {
-	Key key;
-	Key value;
-} TAP_PACKED;
-
 static int dict_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	Py_ssize_t pos = 0;
@@ -31,19 +26,20 @@ static int dict_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t dict_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t dict_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	return sizeof (Item) * PyDict_Size(object);
+	return wire_length_size(version) + wire_key_size(version) * 2 * PyDict_Size(object);
 }
 
-static int dict_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int dict_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
-	Item *portable = reinterpret_cast<Item *> (buf);
 	Py_ssize_t pos = 0;
 	PyObject *key_o;
 	PyObject *value_o;
 
-	for (Py_ssize_t i = 0; PyDict_Next(object, &pos, &key_o, &value_o); ++i) {
+	writer.length(PyDict_Size(object));
+
+	while (PyDict_Next(object, &pos, &key_o, &value_o)) {
 		Key key_rk = peer.key_for_remote(key_o);
 		if (key_rk < 0)
 			return -1;
@@ -52,36 +48,55 @@ static int dict_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject
 		if (value_rk < 0)
 			return -1;
 
-		Item &item = portable[i];
-		item.key = port(key_rk);
-		item.value = port(value_rk);
+		writer.key(key_rk);
+		writer.key(value_rk);
 	}
 
 	return 0;
 }
 
-static PyObject *dict_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+// Reads the next item's key and value objects.
+static int dict_unmarshal_item(Reader &reader, PeerObject &peer, PyObject **key, PyObject **value) noexcept
+{
+	Key key_key;
+	Key value_key;
+
+	if (!reader.key(&key_key) || !reader.key(&value_key))
+		return -1;
+
+	*key = peer.object(key_key);
+	if (*key == nullptr)
+		return -1;
+
+	*value = peer.object(value_key);
+	if (*value == nullptr)
+		return -1;
+
+	return 0;
+}
+
+static PyObject *dict_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size % sizeof (Item))
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key) * 2, &length))
 		return nullptr;
 
 	return PyDict_New();
 }
 
-static int dict_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int dict_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	const Item *portable = reinterpret_cast<const Item *> (data);
-	Py_ssize_t length = size / sizeof (Item);
+	Py_ssize_t length;
 
-	for (Py_ssize_t i = 0; i < length; ++i) {
-		const Item &item = portable[i];
+	if (!reader.length(sizeof (Key) * 2, &length))
+		return -1;
 
-		PyObject *key = peer.object(port(item.key));
-		if (key == nullptr)
-			return -1;
+	for (Py_ssize_t i = 0; i < length; ++i) {
+		PyObject *key;
+		PyObject *value;
 
-		PyObject *value = peer.object(port(item.value));
-		if (value == nullptr)
+		if (dict_unmarshal_item(reader, peer, &key, &value) < 0)
 			return -1;
 
 		if (PyDict_SetItem(object, key, value) < 0)
@@ -91,27 +106,37 @@ static int dict_unmarshal_init(PyObject *object, const void *data, Py_ssize_t si
 	return 0;
 }
 
-static int dict_unmarshal_update(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int dict_unmarshal_update(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	if (size % sizeof (Item))
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key) * 2, &length))
 		return -1;
 
-	const Item *portable = reinterpret_cast<const Item *> (data);
-	Py_ssize_t length = size / sizeof (Item);
-	std::unordered_set<PyObject *> included_keys;
+	Reader items = reader;
 
 	for (Py_ssize_t i = 0; i < length; ++i) {
-		const Item &item = portable[i];
+		PyObject *key;
+		PyObject *value;
 
-		PyObject *key = peer.object(port(item.key));
-		if (key == nullptr)
+		if (dict_unmarshal_item(reader, peer, &key, &value) < 0)
 			return -1;
 
-		PyObject *value = peer.object(port(item.value));
-		if (value == nullptr)
+		if (PyDict_SetItem(object, key, value) < 0)
 			return -1;
+	}
 
-		if (PyDict_SetItem(object, key, value) < 0)
+	// the items are read again only if some keys were removed
+	if (PyDict_Size(object) == length)
+		return 0;
+
+	std::unordered_set<PyObject *> included_keys;
+
+	for (Py_ssize_t i = 0; i < length; ++i) {
+		PyObject *key;
+		PyObject *value;
+
+		if (dict_unmarshal_item(items, peer, &key, &value) < 0)
 			return -1;
 
 		try {
@@ -0,0 +1,46 @@
+#include "core.hpp"
+
+namespace tap {
+
+static int float_traverse(PyObject *object, visitproc visit, void *arg) noexcept
+{
+	return 0;
+}
+
+static Py_ssize_t float_marshaled_size(PyObject *object, unsigned int version) noexcept
+{
+	return sizeof (double);
+}
+
+// IEEE 754 binary64, little-endian in every version.
+static int float_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	writer.float64(PyFloat_AS_DOUBLE(object));
+	return 0;
+}
+
+static PyObject *float_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	double value;
+
+	if (!reader.float64(&value) || !reader.at_end())
+		return nullptr;
+
+	return PyFloat_FromDouble(value);
+}
+
+static int float_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	return 0;
+}
+
+const TypeHandler float_type_handler = {
+	FLOAT_TYPE_ID,
+	float_traverse,
+	float_marshaled_size,
+	float_marshal,
+	float_unmarshal_alloc,
+	float_unmarshal_init,
+};
+
+} // namespace tap
@@ -1,7 +1,7 @@
 #include "core.hpp"
-#include "portable.hpp"
 
 #include <algorithm>
+#include <climits>
 
 #define TAP_FRAME_MAXBLOCKS  20
 // XXX: assert(TAP_FRAME_MAXBLOCKS == CO_MAXBLOCKS)
@@ -12,8 +12,10 @@ struct PortableTryBlock {
 	int32_t type;
 	int32_t handler;
 	int32_t level;
-} TAP_PACKED;
+};
 
+// Fields in wire order, up to the count of the localsplus keys which
+// follow them.
 struct Portable {
 	Key back;
 	Key code;
@@ -32,8 +34,38 @@ struct Portable {
 	int32_t iblock;
 	uint8_t executing;
 	PortableTryBlock blockstack[TAP_FRAME_MAXBLOCKS];
-	Key localsplus[];
-} TAP_PACKED;
+	Py_ssize_t localsplus_num;
+};
+
+static bool frame_read(Reader &reader, Portable *portable) noexcept
+{
+	if (!(reader.key(&portable->back) &&
+	      reader.key(&portable->code) &&
+	      reader.key(&portable->builtins) &&
+	      reader.key(&portable->globals) &&
+	      reader.key(&portable->locals) &&
+	      reader.int32(&portable->valuestack) &&
+	      reader.int32(&portable->stacktop) &&
+	      reader.key(&portable->trace) &&
+	      reader.key(&portable->exc_type) &&
+	      reader.key(&portable->exc_value) &&
+	      reader.key(&portable->exc_traceback) &&
+	      reader.key(&portable->gen) &&
+	      reader.int32(&portable->lasti) &&
+	      reader.int32(&portable->lineno) &&
+	      reader.int32(&portable->iblock) &&
+	      reader.uint8(&portable->executing)))
+		return false;
+
+	for (int i = 0; i < TAP_FRAME_MAXBLOCKS; i++) {
+		PortableTryBlock &block = portable->blockstack[i];
+
+		if (!reader.int32(&block.type) || !reader.int32(&block.handler) || !reader.int32(&block.level))
+			return false;
+	}
+
+	return reader.length(sizeof (Key), &portable->localsplus_num) && portable->localsplus_num <= INT_MAX;
+}
 
 static int frame_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
@@ -65,7 +97,7 @@ static int frame_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t frame_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t frame_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	const PyFrameObject *frameobject = reinterpret_cast<PyFrameObject *> (object);
 	auto localsplus = const_cast<PyObject **> (frameobject->f_localsplus);
@@ -80,7 +112,10 @@ static Py_ssize_t frame_marshaled_size(PyObject *object) noexcept
 
 	// XXX: how much over the stacktop do we need to allocate?
 
-	return sizeof (Portable) + localsplus_num * sizeof (Key);
+	return wire_key_size(version) * (10 + localsplus_num) +
+	       wire_int32_size(version) * (5 + TAP_FRAME_MAXBLOCKS * 3) +
+	       sizeof (uint8_t) +
+	       wire_length_size(version);
 }
 
 #define TAP_FRAME_MARSHAL_OBJECT(NAME) \
@@ -92,17 +127,16 @@ static Py_ssize_t frame_marshaled_size(PyObject *object) noexcept
 			if (remote_key < 0) \
 				return -1; \
 		} \
-		portable->NAME = port(remote_key); \
+		writer.key(remote_key); \
 	} while (0)
 
 #define TAP_FRAME_MARSHAL_VALUE(NAME) \
-	portable->NAME = port(frameobject->f_##NAME)
+	writer.int32(frameobject->f_##NAME)
 
-static int frame_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int frame_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	const PyFrameObject *frameobject = reinterpret_cast<PyFrameObject *> (object);
 	auto localsplus = const_cast<PyObject **> (frameobject->f_localsplus);
-	Portable *portable = reinterpret_cast<Portable *> (buf);
 
 	TAP_FRAME_MARSHAL_OBJECT(back);
 	TAP_FRAME_MARSHAL_OBJECT(code);
@@ -111,12 +145,12 @@ static int frame_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObjec
 	TAP_FRAME_MARSHAL_OBJECT(locals);
 
 	int32_t valuestack = frameobject->f_valuestack - localsplus;
-	portable->valuestack = port(valuestack);
+	writer.int32(valuestack);
 
 	int32_t stacktop = -1;
 	if (frameobject->f_stacktop)
 		stacktop = frameobject->f_stacktop - localsplus;
-	portable->stacktop = port(stacktop);
+	writer.int32(stacktop);
 
 	TAP_FRAME_MARSHAL_OBJECT(trace);
 	TAP_FRAME_MARSHAL_OBJECT(exc_type);
@@ -126,18 +160,20 @@ static int frame_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObjec
 	TAP_FRAME_MARSHAL_VALUE(lasti);
 	TAP_FRAME_MARSHAL_VALUE(lineno);
 	TAP_FRAME_MARSHAL_VALUE(iblock);
-	TAP_FRAME_MARSHAL_VALUE(executing);
+	writer.uint8(frameobject->f_executing);
 
 	for (int i = 0; i < TAP_FRAME_MAXBLOCKS; i++) {
 		const PyTryBlock &block = frameobject->f_blockstack[i];
-		PortableTryBlock &portable_block = portable->blockstack[i];
 
-		portable_block.type = port(int32_t(block.b_type));
-		portable_block.handler = port(int32_t(block.b_handler));
-		portable_block.level = port(int32_t(block.b_level));
+		writer.int32(block.b_type);
+		writer.int32(block.b_handler);
+		writer.int32(block.b_level);
 	}
 
-	for (int i = 0; i < std::max(valuestack, stacktop); i++) {
+	int localsplus_num = std::max(valuestack, stacktop);
+	writer.length(localsplus_num);
+
+	for (int i = 0; i < localsplus_num; i++) {
 		Key remote_key = -1;
 		PyObject *object = frameobject->f_localsplus[i];
 		if (object) {
@@ -145,7 +181,7 @@ static int frame_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObjec
 			if (remote_key < 0)
 				return -1;
 		}
-		portable->localsplus[i] = port(remote_key);
+		writer.key(remote_key);
 	}
 
 	return 0;
@@ -154,24 +190,21 @@ static int frame_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObjec
 #undef TAP_FRAME_MARSHAL_OBJECT
 #undef TAP_FRAME_MARSHAL_VALUE
 
-static PyObject *frame_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *frame_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size < Py_ssize_t(sizeof (Portable)))
-		return nullptr;
+	Portable portable;
 
-	Py_ssize_t localsplus_size = size - Py_ssize_t(sizeof (Portable));
-	if (localsplus_size % sizeof (Key))
+	if (!frame_read(reader, &portable))
 		return nullptr;
-	int localsplus_num = localsplus_size / sizeof (Key);
 
 	// XXX: to we need to subtract sizeof (PyObject *) from PyFrameObject size?
-	return reinterpret_cast<PyObject *> (PyObject_NEW_VAR(PyFrameObject, &PyFrame_Type, localsplus_num));
+	return reinterpret_cast<PyObject *> (PyObject_NEW_VAR(PyFrameObject, &PyFrame_Type, portable.localsplus_num));
 }
 
 #define TAP_FRAME_UNMARSHAL_KEY(NAME) \
 	do { \
 		PyObject *object = nullptr; \
-		Key key = port(portable->NAME); \
+		Key key = portable.NAME; \
 		if (key >= 0) { \
 			object = peer.object(key); \
 			if (object == nullptr) { \
@@ -186,7 +219,7 @@ static PyObject *frame_unmarshal_alloc(const void *data, Py_ssize_t size, PeerOb
 #define TAP_FRAME_UNMARSHAL_KEY_TYPE(NAME, TYPE) \
 	do { \
 		TYPE##Object *typed_object = nullptr; \
-		Key key = port(portable->NAME); \
+		Key key = portable.NAME; \
 		if (key >= 0) { \
 			PyObject *object = peer.object(key); \
 			if (object == nullptr) { \
@@ -204,13 +237,17 @@ static PyObject *frame_unmarshal_alloc(const void *data, Py_ssize_t size, PeerOb
 	} while (0)
 
 #define TAP_FRAME_UNMARSHAL_VALUE(NAME) \
-	frameobject->f_##NAME = port(portable->NAME)
+	frameobject->f_##NAME = portable.NAME
 
-static int frame_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int frame_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	PyFrameObject *frameobject = reinterpret_cast<PyFrameObject *> (object);
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
-	int localsplus_num = (size - sizeof (Portable)) / sizeof (Key);
+	Portable portable;
+
+	if (!frame_read(reader, &portable))
+		return -1;
+
+	int localsplus_num = portable.localsplus_num;
 
 	TAP_FRAME_UNMARSHAL_KEY_TYPE(back, PyFrame);
 	TAP_FRAME_UNMARSHAL_KEY_TYPE(code, PyCode);
@@ -218,10 +255,10 @@ static int frame_unmarshal_init(PyObject *object, const void *data, Py_ssize_t s
 	TAP_FRAME_UNMARSHAL_KEY(globals);
 	TAP_FRAME_UNMARSHAL_KEY(locals);
 
-	int32_t valuestack = port(portable->valuestack);
+	int32_t valuestack = portable.valuestack;
 	frameobject->f_valuestack = frameobject->f_localsplus + valuestack;
 
-	int32_t stacktop = port(portable->valuestack);
+	int32_t stacktop = portable.valuestack;
 	if (stacktop >= 0) {
 		frameobject->f_stacktop = frameobject->f_localsplus + stacktop;
 	} else {
@@ -236,7 +273,7 @@ static int frame_unmarshal_init(PyObject *object, const void *data, Py_ssize_t s
 
 	// don't Py_INCREF the borrowed gen reference
 	PyObject *gen_object = nullptr;
-	Key gen_key = port(portable->gen);
+	Key gen_key = portable.gen;
 	if (gen_key >= 0) {
 		gen_object = peer.object(gen_key);
 		if (gen_object == nullptr) {
@@ -252,17 +289,19 @@ static int frame_unmarshal_init(PyObject *object, const void *data, Py_ssize_t s
 	TAP_FRAME_UNMARSHAL_VALUE(executing);
 
 	for (int i = 0; i < TAP_FRAME_MAXBLOCKS; i++) {
-		const PortableTryBlock &portable_block = portable->blockstack[i];
+		const PortableTryBlock &portable_block = portable.blockstack[i];
 		PyTryBlock &block = frameobject->f_blockstack[i];
 
-		block.b_type = port(portable_block.type);
-		block.b_handler = port(portable_block.handler);
-		block.b_level = port(portable_block.level);
+		block.b_type = portable_block.type;
+		block.b_handler = portable_block.handler;
+		block.b_level = portable_block.level;
 	}
 
 	for (int i = 0; i < localsplus_num; i++) {
 		PyObject *object = nullptr;
-		Key key = port(portable->localsplus[i]);
+		Key key;
+		if (!reader.key(&key))
+			return -1;
 		if (key >= 0) {
 			object = peer.object(key);
 			if (object == nullptr) {
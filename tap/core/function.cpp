@@ -3,20 +3,9 @@
 
 namespace tap {
 
-struct Portable {
-	Key code;
-	Key globals;
-	Key defaults;
-	Key kwdefaults;
-	Key closure;
-	Key doc;
-	Key name;
-	Key dict;
-	Key weakreflist;
-	Key module;
-	Key annotations;
-	Key qualname;
-} TAP_PACKED;
+enum {
+	FIELD_COUNT = 12,
+};
 
 static int function_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
@@ -38,9 +27,9 @@ static int function_traverse(PyObject *object, visitproc visit, void *arg) noexc
 	return 0;
 }
 
-static Py_ssize_t function_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t function_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	return sizeof (Portable);
+	return wire_key_size(version) * FIELD_COUNT;
 }
 
 #define TAP_FUNCTION_MARSHAL_OBJECT(NAME) \
@@ -51,13 +40,12 @@ static Py_ssize_t function_marshaled_size(PyObject *object) noexcept
 			if (remote_key < 0) \
 				return -1; \
 		} \
-		portable->NAME = port(remote_key); \
+		writer.key(remote_key); \
 	} while (0)
 
-static int function_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int function_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	const PyFunctionObject *function = reinterpret_cast<PyFunctionObject *> (object);
-	Portable *portable = reinterpret_cast<Portable *> (buf);
 
 	TAP_FUNCTION_MARSHAL_OBJECT(code);
 	TAP_FUNCTION_MARSHAL_OBJECT(globals);
@@ -77,9 +65,16 @@ static int function_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerOb
 
 #undef TAP_FUNCTION_MARSHAL_OBJECT
 
-static PyObject *function_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *function_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size != sizeof (Portable))
+	for (int i = 0; i < FIELD_COUNT; i++) {
+		Key key;
+
+		if (!reader.key(&key))
+			return nullptr;
+	}
+
+	if (!reader.at_end())
 		return nullptr;
 
 	return reinterpret_cast<PyObject *> (PyObject_GC_New(PyFunctionObject, &PyFunction_Type));
@@ -88,7 +83,9 @@ static PyObject *function_unmarshal_alloc(const void *data, Py_ssize_t size, Pee
 #define TAP_FUNCTION_UNMARSHAL_KEY(NAME) \
 	do { \
 		PyObject *ptr = nullptr; \
-		Key key = port(portable->NAME); \
+		Key key; \
+		if (!reader.key(&key)) \
+			return -1; \
 		if (key != -1) { \
 			ptr = peer.object(key); \
 			if (ptr == nullptr) { \
@@ -100,11 +97,11 @@ static PyObject *function_unmarshal_alloc(const void *data, Py_ssize_t size, Pee
 		function->func_##NAME = ptr; \
 	} while (0)
 
-static int function_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int function_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
 	PyFunctionObject *function = reinterpret_cast<PyFunctionObject *> (object);
 
+	// the layout was validated by function_unmarshal_alloc
 	TAP_FUNCTION_UNMARSHAL_KEY(code);
 	TAP_FUNCTION_UNMARSHAL_KEY(globals);
 	TAP_FUNCTION_UNMARSHAL_KEY(defaults);
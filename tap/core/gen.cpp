@@ -3,13 +3,6 @@
 
 namespace tap {
 
-struct Portable {
-	Key frame;
-	uint8_t running;
-	Key code;
-	Key weakreflist;
-} TAP_PACKED;
-
 static int gen_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	const PyGenObject *self = reinterpret_cast<PyGenObject *> (object);
@@ -21,9 +14,9 @@ static int gen_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t gen_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t gen_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	return sizeof (Portable);
+	return wire_key_size(version) * 3 + sizeof (uint8_t);
 }
 
 #define TAP_GEN_MARSHAL_OBJECT(NAME) \
@@ -35,16 +28,15 @@ static Py_ssize_t gen_marshaled_size(PyObject *object) noexcept
 			if (remote_key < 0) \
 				return -1; \
 		} \
-		portable->NAME = port(remote_key); \
+		writer.key(remote_key); \
 	} while (0)
 
 #define TAP_GEN_MARSHAL_VALUE(NAME) \
-	portable->NAME = port(genobject->gi_##NAME)
+	writer.uint8(genobject->gi_##NAME)
 
-static int gen_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int gen_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	const PyGenObject *genobject = reinterpret_cast<PyGenObject *> (object);
-	Portable *portable = reinterpret_cast<Portable *> (buf);
 
 	TAP_GEN_MARSHAL_OBJECT(frame);
 	TAP_GEN_MARSHAL_VALUE(running);
@@ -57,10 +49,15 @@ static int gen_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject
 #undef TAP_GEN_MARSHAL_OBJECT
 #undef TAP_GEN_MARSHAL_VALUE
 
-static PyObject *gen_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *gen_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size != sizeof (Portable))
-	    return nullptr;
+	Key frame;
+	uint8_t running;
+	Key code;
+	Key weakreflist;
+
+	if (!reader.key(&frame) || !reader.uint8(&running) || !reader.key(&code) || !reader.key(&weakreflist) || !reader.at_end())
+		return nullptr;
 
 	return reinterpret_cast<PyObject *> (PyObject_GC_New(PyGenObject, &PyGen_Type));
 }
@@ -68,7 +65,9 @@ static PyObject *gen_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObje
 #define TAP_GEN_UNMARSHAL_KEY(NAME) \
 	do { \
 		PyObject *object = nullptr; \
-		Key key = port(portable->NAME); \
+		Key key; \
+		if (!reader.key(&key)) \
+			return -1; \
 		if (key >= 0) { \
 			object = peer.object(key); \
 			if (object == nullptr) { \
@@ -83,7 +82,9 @@ static PyObject *gen_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObje
 #define TAP_GEN_UNMARSHAL_KEY_TYPE(NAME, TYPE) \
 	do { \
 		TYPE##Object *typed_object = nullptr; \
-		Key key = port(portable->NAME); \
+		Key key; \
+		if (!reader.key(&key)) \
+			return -1; \
 		if (key >= 0) { \
 			PyObject *object = peer.object(key); \
 			if (object == nullptr) { \
@@ -101,16 +102,21 @@ static PyObject *gen_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObje
 	} while (0)
 
 #define TAP_GEN_UNMARSHAL_VALUE(NAME) \
-	genobject->gi_##NAME = port(portable->NAME)
+	do { \
+		uint8_t value; \
+		if (!reader.uint8(&value)) \
+			return -1; \
+		genobject->gi_##NAME = value; \
+	} while (0)
 
-static int gen_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int gen_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	PyGenObject *genobject = reinterpret_cast<PyGenObject *> (object);
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
 
+	// the layout was validated by gen_unmarshal_alloc
 	TAP_GEN_UNMARSHAL_KEY_TYPE(frame, PyFrame);
-	TAP_GEN_UNMARSHAL_KEY(code);
 	TAP_GEN_UNMARSHAL_VALUE(running);
+	TAP_GEN_UNMARSHAL_KEY(code);
 	TAP_GEN_UNMARSHAL_KEY(weakreflist);
 
 	_PyObject_GC_TRACK(genobject);
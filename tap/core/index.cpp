@@ -0,0 +1,186 @@
+#include "core.hpp"
+
+#include <algorithm>
+
+namespace tap {
+
+ObjectIndex::ObjectIndex() noexcept:
+	current_epoch(1),
+	journal_epoch(0),
+	low(UINTPTR_MAX),
+	high(0)
+{
+}
+
+ObjectIndex::~ObjectIndex() noexcept
+{
+	ids.for_each([this](void *ptr, int32_t id) {
+		delete entries[id].other_peers;
+	});
+}
+
+int32_t ObjectIndex::subscribe(PyObject *object, PeerObject *peer) noexcept
+{
+	int32_t *id_ptr;
+	size_t count = ids.size();
+
+	try {
+		id_ptr = ids.insert(object);
+	} catch (...) {
+		return -1;
+	}
+
+	if (ids.size() != count) {
+		int32_t id;
+
+		if (!free_ids.empty()) {
+			id = free_ids.back();
+			free_ids.pop_back();
+		} else if (entries.size() < 0x7fffffff) {
+			id = entries.size();
+
+			try {
+				entries.push_back(Entry());
+			} catch (...) {
+				ids.erase(object);
+				return -1;
+			}
+		} else {
+			ids.erase(object);
+			return -1;
+		}
+
+		*id_ptr = id;
+		// a new entry counts as modified at the first epoch, so that it
+		// doesn't look modified to journaling peers
+		entries[id] = Entry { peer, nullptr, 1 };
+
+		uintptr_t addr = reinterpret_cast<uintptr_t> (object);
+		low = std::min(low, addr);
+		high = std::max(high, addr + 1);
+
+		return id;
+	}
+
+	int32_t id = *id_ptr;
+	Entry &entry = entries[id];
+
+	if (entry.peer == peer)
+		return id;
+
+	try {
+		if (entry.other_peers == nullptr)
+			entry.other_peers = new std::vector<PeerObject *>;
+
+		auto &others = *entry.other_peers;
+
+		if (std::find(others.begin(), others.end(), peer) == others.end())
+			others.push_back(peer);
+	} catch (...) {
+		return -1;
+	}
+
+	return id;
+}
+
+void ObjectIndex::unsubscribe(PyObject *object, PeerObject *peer) noexcept
+{
+	int32_t *id_ptr = ids.find(object);
+	if (id_ptr == nullptr)
+		return;
+
+	int32_t id = *id_ptr;
+	Entry &entry = entries[id];
+	auto others = entry.other_peers;
+
+	if (entry.peer == peer) {
+		if (others && !others->empty()) {
+			entry.peer = others->back();
+			others->pop_back();
+		} else {
+			entry.peer = nullptr;
+		}
+	} else if (others) {
+		auto i = std::find(others->begin(), others->end(), peer);
+		if (i != others->end())
+			others->erase(i);
+	}
+
+	if (entry.peer == nullptr)
+		release(object, id);
+}
+
+void ObjectIndex::release(void *ptr, int32_t id) noexcept
+{
+	delete entries[id].other_peers;
+	entries[id] = Entry();
+
+	ids.erase(ptr);
+
+	try {
+		free_ids.push_back(id);
+	} catch (...) {
+		// the entry is leaked
+	}
+}
+
+void ObjectIndex::touch(PyObject *object) noexcept
+{
+	int32_t *id_ptr = ids.find(object);
+	if (id_ptr == nullptr)
+		return;
+
+	Entry &entry = entries[*id_ptr];
+	uint64_t modified = entry.epoch;
+
+	entry.epoch = ++current_epoch;
+
+	// the object is already in the journals if it was modified after the
+	// latest journaling period began
+	if (modified <= journal_epoch) {
+		entry.peer->object_touched(object, modified);
+
+		if (entry.other_peers) {
+			for (PeerObject *other: *entry.other_peers)
+				other->object_touched(object, modified);
+		}
+	}
+}
+
+void ObjectIndex::object_freed(void *ptr) noexcept
+{
+	uintptr_t addr = reinterpret_cast<uintptr_t> (ptr);
+
+	// garbage-collected objects are freed via their GC header
+	if (addr + sizeof (PyGC_Head) < low || addr >= high)
+		return;
+
+	int32_t *id_ptr = ids.find(ptr);
+	if (id_ptr == nullptr) {
+		ptr = reinterpret_cast<PyGC_Head *> (ptr) + 1;
+
+		// a non-GC object may just happen to follow the freed block
+		id_ptr = ids.find(ptr);
+		if (id_ptr == nullptr || !PyObject_IS_GC(reinterpret_cast<PyObject *> (ptr)))
+			return;
+	}
+
+	int32_t id = *id_ptr;
+	PyObject *object = reinterpret_cast<PyObject *> (ptr);
+	PeerObject *peer = entries[id].peer;
+	std::vector<PeerObject *> *others = entries[id].other_peers;
+
+	entries[id].other_peers = nullptr;
+	release(ptr, id);
+
+	peer->object_freed(object);
+
+	if (others) {
+		for (PeerObject *other: *others)
+			other->object_freed(object);
+
+		delete others;
+	}
+}
+
+} // namespace tap
@@ -11,9 +11,10 @@ static PyObject *marshal_py(PyObject *self, PyObject *args) noexcept
 	PyObject *peer;
 	PyObject *bytearray;
 	PyObject *object = nullptr;
+	unsigned int flags = 0;
 
-	if (PyArg_ParseTuple(args, "O!O!|O", &peer_type, &peer, &PyByteArray_Type, &bytearray, &object)) {
-		if (marshal(*reinterpret_cast <PeerObject *>(peer), bytearray, object) == 0) {
+	if (PyArg_ParseTuple(args, "O!O!|OI", &peer_type, &peer, &PyByteArray_Type, &bytearray, &object, &flags)) {
+		if (marshal(*reinterpret_cast <PeerObject *>(peer), bytearray, object, flags) == 0) {
 			Py_INCREF(Py_None);
 			result = Py_None;
 		}
@@ -22,6 +23,46 @@ static PyObject *marshal_py(PyObject *self, PyObject *args) noexcept
 	return result;
 }
 
+static PyObject *marshal_into_py(PyObject *self, PyObject *args) noexcept
+{
+	PyObject *result = nullptr;
+	PyObject *peer;
+	Py_buffer buffer;
+	Py_ssize_t offset;
+	PyObject *object = nullptr;
+	unsigned int flags = 0;
+
+	if (!PyArg_ParseTuple(args, "O!w*n|OI", &peer_type, &peer, &buffer, &offset, &object, &flags))
+		return nullptr;
+
+	if (offset < 0 || offset > buffer.len) {
+		PyErr_SetString(PyExc_ValueError, "offset out of range");
+	} else {
+		void *buf = reinterpret_cast<char *> (buffer.buf) + offset;
+		Py_ssize_t size = marshal_into(*reinterpret_cast <PeerObject *>(peer), buf, buffer.len - offset, object, flags);
+		if (size >= 0)
+			result = PyLong_FromSsize_t(size);
+	}
+
+	PyBuffer_Release(&buffer);
+
+	return result;
+}
+
+static PyObject *marshal_segments_py(PyObject *self, PyObject *args) noexcept
+{
+	PyObject *peer;
+	PyObject *bytearray;
+	PyObject *object = nullptr;
+	unsigned int flags = 0;
+	Py_ssize_t threshold = 4096;
+
+	if (!PyArg_ParseTuple(args, "O!O!|OIn", &peer_type, &peer, &PyByteArray_Type, &bytearray, &object, &flags, &threshold))
+		return nullptr;
+
+	return marshal_segments(*reinterpret_cast <PeerObject *>(peer), bytearray, object, flags, threshold);
+}
+
 static PyObject *unmarshal_py(PyObject *self, PyObject *args) noexcept
 {
 	PyObject *result = nullptr;
@@ -29,15 +70,45 @@ static PyObject *unmarshal_py(PyObject *self, PyObject *args) noexcept
 	Py_buffer buffer;
 
 	if (PyArg_ParseTuple(args, "O!y*", &peer_type, &peer, &buffer)) {
-		result = unmarshal(*reinterpret_cast <PeerObject *>(peer), buffer.buf, buffer.len);
+		result = unmarshal(*reinterpret_cast <PeerObject *>(peer), buffer.buf, buffer.len, buffer.obj);
 		PyBuffer_Release(&buffer);
 	}
 
 	return result;
 }
 
+static int api_register_type(PyTypeObject *type, const TypeHandler *handler) noexcept
+{
+	if (handler->type_id < TYPE_ID_EXTENSION_BASE || type_register(type, handler) < 0) {
+		PyErr_Format(PyExc_ValueError, "cannot register type %s with type id %d", type->tp_name, int(handler->type_id));
+		return -1;
+	}
+
+	return 0;
+}
+
+static Key api_key_for_remote(PeerObject &peer, PyObject *object) noexcept
+{
+	return peer.key_for_remote(object);
+}
+
+static PyObject *api_object(PeerObject &peer, Key key) noexcept
+{
+	return peer.object(key);
+}
+
+static const API api = {
+	API_VERSION,
+	api_register_type,
+	api_key_for_remote,
+	api_object,
+	peers_touch,
+};
+
 static PyMethodDef method_defs[] = {
 	{ "marshal", marshal_py, METH_VARARGS },
+	{ "marshal_into", marshal_into_py, METH_VARARGS },
+	{ "marshal_segments", marshal_segments_py, METH_VARARGS },
 	{ "unmarshal", unmarshal_py, METH_VARARGS },
 	{}
 };
@@ -57,11 +128,23 @@ PyMODINIT_FUNC PyInit_core() noexcept
 	if (instance_init() < 0)
 		return nullptr;
 
+	if (type_init() < 0)
+		return nullptr;
+
 	if (peer_type_init() < 0)
 		return nullptr;
 
+	if (view_type_init() < 0)
+		return nullptr;
+
+	if (buffer_type_init() < 0)
+		return nullptr;
+
 	list_py_type_init();
 	dict_py_type_init();
+	set_py_type_init();
+
+	unicode_init();
 
 	allocator_init();
 
@@ -72,5 +155,18 @@ PyMODINIT_FUNC PyInit_core() noexcept
 	Py_INCREF(&peer_type);
 	PyModule_AddObject(module_obj, "Peer", (PyObject *) &peer_type);
 
+	PyObject *api_capsule = PyCapsule_New(const_cast<API *> (&api), TAP_CORE_API_CAPSULE, nullptr);
+	if (api_capsule == nullptr) {
+		Py_DECREF(module_obj);
+		return nullptr;
+	}
+
+	PyModule_AddObject(module_obj, "_api", api_capsule);
+
+	PyModule_AddIntConstant(module_obj, "MARSHAL_PRESIZED", MARSHAL_PRESIZED);
+	PyModule_AddIntConstant(module_obj, "MARSHAL_INCREMENTAL", MARSHAL_INCREMENTAL);
+	PyModule_AddIntConstant(module_obj, "MARSHAL_NEGOTIATE", MARSHAL_NEGOTIATE);
+	PyModule_AddIntConstant(module_obj, "WIRE_VERSION", WIRE_VERSION);
+
 	return module_obj;
 }
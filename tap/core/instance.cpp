@@ -3,8 +3,12 @@
 namespace tap {
 
 struct Instance {
-	std::unordered_set<PeerObject *> peers;
+	ObjectIndex index;
 	std::unordered_map<std::string, PyTypeObject *> opaque_types;
+	PointerTable<const TypeHandler *> type_handlers;
+	std::vector<TypeRegistration> type_registrations;
+	PointerTable<setattrofunc> object_setattros;
+	std::unordered_map<Py_hash_t, BuiltinResolution> builtins;  // by record payload hash
 };
 
 static Instance *instance;
@@ -20,9 +24,9 @@ int instance_init() noexcept
 	return 0;
 }
 
-std::unordered_set<PeerObject *> &instance_peers() noexcept
+ObjectIndex &instance_index() noexcept
 {
-	return instance->peers;
+	return instance->index;
 }
 
 std::unordered_map<std::string, PyTypeObject *> &instance_opaque_types() noexcept
@@ -30,4 +34,24 @@ std::unordered_map<std::string, PyTypeObject *> &instance_opaque_types() noexcep
 	return instance->opaque_types;
 }
 
+PointerTable<const TypeHandler *> &instance_type_handlers() noexcept
+{
+	return instance->type_handlers;
+}
+
+std::vector<TypeRegistration> &instance_type_registrations() noexcept
+{
+	return instance->type_registrations;
+}
+
+PointerTable<setattrofunc> &instance_object_setattros() noexcept
+{
+	return instance->object_setattros;
+}
+
+std::unordered_map<Py_hash_t, BuiltinResolution> &instance_builtins() noexcept
+{
+	return instance->builtins;
+}
+
 } // namespace tap
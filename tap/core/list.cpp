@@ -1,6 +1,5 @@
 #include "core.hpp"
 #include "mapping.hpp"
-#include "portable.hpp"
 
 #include <stdexcept>
 #include <vector>
@@ -20,87 +19,79 @@ static int list_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t list_marshaled_size(PyObject *object) noexcept
+static PyObject *const *list_items(PyObject *object) noexcept
 {
-	return sizeof (Key) * PyList_GET_SIZE(object);
+	return reinterpret_cast<PyListObject *> (object)->ob_item;
 }
 
-static int list_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static Py_ssize_t list_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	Key *portable = reinterpret_cast<Key *> (buf);
-
-	for (Py_ssize_t i = 0; i < PyList_GET_SIZE(object); ++i) {
-		Key remote_key = peer.key_for_remote(PyList_GET_ITEM(object, i));
-		if (remote_key < 0)
-			return -1;
-
-		portable[i] = port(remote_key);
-	}
+	return sequence_marshaled_size(list_items(object), PyList_GET_SIZE(object), version);
+}
 
-	return 0;
+static int list_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	return sequence_marshal(list_items(object), PyList_GET_SIZE(object), writer, peer);
 }
 
-static PyObject *list_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *list_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size % sizeof (Key))
+	SequenceLayout layout;
+	Py_ssize_t length;
+
+	if (!sequence_read_header(reader, &layout, &length))
 		return nullptr;
 
-	return PyList_New(size / sizeof (Key));
+	return PyList_New(length);
 }
 
-static int list_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int list_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	const Key *portable = reinterpret_cast<const Key *> (data);
-
-	for (Py_ssize_t i = 0; i < PyList_GET_SIZE(object); ++i) {
-		PyObject *item = peer.object(port(portable[i]));
-		if (item == nullptr)
-			return -1;
+	SequenceLayout layout;
+	Py_ssize_t length;
 
-		Py_INCREF(item);
-		PyList_SET_ITEM(object, i, item);
-	}
+	if (!sequence_read_header(reader, &layout, &length) || length != PyList_GET_SIZE(object))
+		return -1;
 
-	return 0;
+	return sequence_unmarshal_items(reader, layout, reinterpret_cast<PyListObject *> (object)->ob_item, length, peer);
 }
 
-static int list_unmarshal_update(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int list_unmarshal_update(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	if (size % sizeof (Key))
+	SequenceLayout layout;
+	Py_ssize_t length;
+
+	if (!sequence_read_header(reader, &layout, &length))
 		return -1;
 
-	const Key *portable = reinterpret_cast<const Key *> (data);
-	std::vector<PyObject *> refs;
+	// the new items are referenced before the old ones are released, since
+	// they may be the same objects
+	std::vector<PyObject *> items;
 
 	try {
-		refs.reserve(PyList_GET_SIZE(object));
+		items.resize(length);
 	} catch (...) {
 		return -1;
 	}
 
-	for (Py_ssize_t i = 0; i < PyList_GET_SIZE(object); ++i) {
-		PyObject *item = PyList_GET_ITEM(object, i);
-		Py_INCREF(item);
-		refs.push_back(item);
-	}
-
-	PyList_SetSlice(object, 0, PyList_GET_SIZE(object), nullptr);
+	if (sequence_unmarshal_items(reader, layout, items.data(), length, peer) < 0)
+		return -1;
 
-	Py_ssize_t length = size / sizeof (Key);
+	int ret = PyList_SetSlice(object, 0, PyList_GET_SIZE(object), nullptr);
 
-	for (Py_ssize_t i = 0; i < length; ++i) {
-		PyObject *item = peer.object(port(portable[i]));
-		if (item == nullptr)
-			return -1;
+	for (PyObject *item: items) {
+		if (ret == 0)
+			ret = PyList_Append(object, item);
 
-		if (PyList_Append(object, item) < 0)
-			return -1;
+		Py_DECREF(item);
 	}
 
-	for (PyObject *item: refs)
-		Py_DECREF(item);
+	return ret;
+}
 
-	return 0;
+static bool list_by_value(PyObject *object, unsigned int version) noexcept
+{
+	return sequence_layout(list_items(object), PyList_GET_SIZE(object), version) != SEQUENCE_REFERENCES;
 }
 
 const TypeHandler list_type_handler = {
@@ -111,6 +102,8 @@ const TypeHandler list_type_handler = {
 	list_unmarshal_alloc,
 	list_unmarshal_init,
 	list_unmarshal_update,
+	nullptr,
+	list_by_value,
 };
 
 } // namespace tap
@@ -3,36 +3,77 @@
 
 namespace tap {
 
+static size_t long_magnitude_size(PyObject *object) noexcept
+{
+	return (_PyLong_NumBits(object) + 7) / 8;
+}
+
 static int long_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	return 0;
 }
 
-static Py_ssize_t long_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t long_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	return sizeof (int64_t);
+	int overflow;
+	PyLong_AsLongLongAndOverflow(object, &overflow);
+	if (overflow == 0)
+		return wire_int64_size(version);
+
+	return wire_int64_size(version) + long_magnitude_size(object);
 }
 
-static int long_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+// Ints which fit in 64 bits are encoded as an int64.  Larger ones are encoded
+// as the sign (1 or -1) followed by the little-endian magnitude, which takes
+// the rest of the record.
+static int long_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	int overflow;
 	int64_t value = PyLong_AsLongLongAndOverflow(object, &overflow);
-	if (overflow != 0)
+	if (overflow == 0) {
+		writer.int64(value);
+		return 0;
+	}
+
+	PyObject *magnitude = PyNumber_Absolute(object);
+	if (magnitude == nullptr)
 		return -1;
 
-	*reinterpret_cast<int64_t *> (buf) = port(value);
-	return 0;
+	size_t size = long_magnitude_size(magnitude);
+
+	writer.int64(overflow);
+	int ret = _PyLong_AsByteArray(reinterpret_cast<PyLongObject *> (magnitude), writer.reserve(size), size, 1, 0);
+
+	Py_DECREF(magnitude);
+	return ret;
 }
 
-static PyObject *long_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *long_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size != sizeof (int64_t))
+	int64_t value;
+
+	if (!reader.int64(&value))
 		return nullptr;
 
-	return PyLong_FromLongLong(port(*reinterpret_cast<const int64_t *> (data)));
+	if (reader.at_end())
+		return PyLong_FromLongLong(value);
+
+	if (value != 1 && value != -1)
+		return nullptr;
+
+	Py_ssize_t size = reader.remaining();
+	auto data = reinterpret_cast<const unsigned char *> (reader.data(size));
+
+	PyObject *magnitude = _PyLong_FromByteArray(data, size, 1, 0);
+	if (magnitude == nullptr || value > 0)
+		return magnitude;
+
+	PyObject *object = PyNumber_Negative(magnitude);
+	Py_DECREF(magnitude);
+	return object;
 }
 
-static int long_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int long_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -1,12 +1,16 @@
 #include "core.hpp"
 #include "portable.hpp"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
-#include <unordered_set>
+#include <vector>
 
 namespace tap {
 
+// The low byte of a section id is a SectionId, the rest is the wire version
+// of the section contents.  Section headers themselves are fixed.
 enum SectionId {
 	OBJECT_SECTION_ID,
 	FREE_SECTION_ID,
@@ -22,12 +26,41 @@ struct ObjectSectionHeader {
 	Key root_key;
 } TAP_PACKED;
 
+// Newer wire versions are offered in a version 0 freed section with the key
+// VERSION_OFFER_KEY + max_version.  No object has such a key, so receivers
+// which predate versioning ignore the offer.
+struct VersionSection {
+	SectionHeader section;
+	Key offer_key;
+} TAP_PACKED;
+
+const Key VERSION_OFFER_KEY = INT64_MIN;
+const Key VERSION_OFFER_LIMIT = VERSION_OFFER_KEY + 0x7fffffff;
+
+// Record header in version 0.  Version 1 uses varints of the type id, the key
+// relative to the previous record's key, and the size of the contents.
+// Version 2 shifts the type id left by one bit; the low bit is set on
+// deferred records.
 struct ObjectHeader {
 	int32_t size;
 	int32_t type_id;
 	Key key;
 } TAP_PACKED;
 
+enum {
+	RECORD_HEADER_BOUND = 25,
+};
+
+static int32_t section_id(SectionId id, unsigned int version) noexcept
+{
+	return int32_t(id | (version << 8));
+}
+
+static Py_ssize_t record_header_bound(unsigned int version) noexcept
+{
+	return version ? Py_ssize_t(RECORD_HEADER_BOUND) : Py_ssize_t(sizeof (ObjectHeader));
+}
+
 static Py_ssize_t extend_and_get_offset(PyObject *bytearray, Py_ssize_t increment) noexcept
 {
 	Py_ssize_t offset = PyByteArray_GET_SIZE(bytearray);
@@ -57,142 +90,627 @@ static T *extend_and_get_buffer(PyObject *bytearray, Py_ssize_t increment, Py_bu
 	return get_buffer_at<T>(bytearray, buffer, offset);
 }
 
+struct MarshalRecord {
+	PyObject *object;
+	const TypeHandler *handler;
+	Key remote_key;
+	Py_ssize_t size;
+	Py_ssize_t payload_size;  // elided from the output
+	bool deferred;
+};
+
+// An object whose references are being visited in dependency order.
+struct MarshalFrame {
+	MarshalRecord record;  // handler is null if nothing is written
+	size_t stack_mark;     // the references are above this in the stack
+	bool hashing;
+	bool incomplete;
+};
+
+// Object data which is left out of the bytearray; it belongs at the offset.
+struct PayloadSegment {
+	Py_ssize_t offset;
+	PyObject *object;
+	const void *data;
+	Py_ssize_t size;
+};
+
 struct ObjectMarshaler {
 	PeerObject &peer;
 	PyObject *bytearray;
-	std::unordered_set<PyObject *> seen;
-
-	ObjectMarshaler(PeerObject &peer, PyObject *bytearray):
+	std::vector<MarshalRecord> records;
+	std::vector<MarshalFrame> frames;
+	std::vector<PyObject *> written;  // records which aren't presized
+	Py_ssize_t records_size;  // upper bound
+	bool presized;
+	bool incremental;
+	unsigned int version;
+	bool ordered;
+	Key prev_key;
+	std::vector<PayloadSegment> *payloads;
+	Py_ssize_t payload_threshold;
+	Py_ssize_t payloads_size;
+
+	ObjectMarshaler(PeerObject &peer, PyObject *bytearray, bool presized, bool incremental, std::vector<PayloadSegment> *payloads, Py_ssize_t payload_threshold):
 		peer(peer),
-		bytearray(bytearray)
+		bytearray(bytearray),
+		records_size(0),
+		presized(presized),
+		incremental(incremental),
+		version(peer.wire_version),
+		ordered(version >= 2),
+		prev_key(0),
+		payloads(payloads),
+		payload_threshold(payload_threshold),
+		payloads_size(0)
+	{
+	}
+
+	Py_ssize_t record_bound(const MarshalRecord &record) const noexcept
+	{
+		return record_header_bound(version) + record.size - record.payload_size;
+	}
+
+	// Returns the size of the object's memory if it should be referenced
+	// instead of copied, or zero.
+	Py_ssize_t payload_size(PyObject *object, const TypeHandler *handler) noexcept
+	{
+		if (payloads == nullptr || handler->payload == nullptr)
+			return 0;
+
+		Py_ssize_t size = handler->payload(object);
+		if (size < payload_threshold)
+			return 0;
+
+		return size;
+	}
+
+	// Marks the collected records as unsent after a failure.
+	void unsend() noexcept
+	{
+		for (const MarshalRecord &record: records)
+			peer.mark_unsent(record.object);
+
+		for (PyObject *object: written)
+			peer.mark_unsent(object);
+
+		for (const MarshalFrame &frame: frames)
+			if (frame.record.handler)
+				peer.mark_unsent(frame.record.object);
+	}
+
+	int add_payload(Py_ssize_t offset, PyObject *object, const void *data, Py_ssize_t size) noexcept
 	{
+		try {
+			payloads->push_back(PayloadSegment { offset, object, data, size });
+		} catch (...) {
+			return -1;
+		}
+
+		payloads_size += size;
+		return 0;
 	}
 };
 
-static int marshal_visit_objects(PyObject *object, void *arg) noexcept
+static Py_ssize_t write_record_header(ObjectMarshaler &marshaler, void *buf, const MarshalRecord &record, Py_ssize_t size) noexcept
 {
-	ObjectMarshaler &marshaler = *reinterpret_cast<ObjectMarshaler *> (arg);
+	if (marshaler.version == 0) {
+		auto header = reinterpret_cast<ObjectHeader *> (buf);
 
-	if (marshaler.seen.find(object) != marshaler.seen.end())
-		return 0;
+		header->size = port(int32_t(sizeof (ObjectHeader) + size));
+		header->type_id = port(record.handler->type_id);
+		header->key = port(record.remote_key);
 
-	try {
-		marshaler.seen.insert(object);
-	} catch (...) {
-		return -1;
+		return sizeof (ObjectHeader);
 	}
 
-	auto pair = marshaler.peer.insert_or_clear_for_remote(object);
-	Key remote_key = pair.first;
-	bool object_changed = pair.second;
+	Writer writer(buf, marshaler.version, 0);
+
+	if (marshaler.ordered)
+		writer.varint((uint32_t(record.handler->type_id) << 1) | record.deferred);
+	else
+		writer.varint(uint32_t(record.handler->type_id));
+	writer.varint(wire_zigzag(record.remote_key - marshaler.prev_key));
+	writer.varint(size);
+
+	marshaler.prev_key = record.remote_key;
+
+	return writer.size();
+}
+
+// Writes a record to buf, which has room for the record's upper bound and is
+// located at offset in the output.  The contents are written after room for
+// the largest header, and moved next to the actual header.  Returns the
+// number of bytes written.
+static Py_ssize_t write_record(ObjectMarshaler &marshaler, const MarshalRecord &record, char *buf, Py_ssize_t offset) noexcept
+{
+	char header[RECORD_HEADER_BOUND];
+	char *contents = buf + record_header_bound(marshaler.version);
+	Writer writer(contents, marshaler.version, record.remote_key);
+
+	if (record.payload_size)
+		writer.elide_payload();
 
-	if (remote_key < 0)
+	if (record.handler->marshal(record.object, writer, marshaler.peer) < 0)
 		return -1;
 
+	Py_ssize_t header_size = write_record_header(marshaler, header, record, writer.size());
+	if (buf + header_size != contents)
+		memmove(buf + header_size, contents, writer.stored_size());
+	memcpy(buf, header, header_size);
+
+	if (record.payload_size) {
+		Py_ssize_t payload_size;
+		Py_ssize_t payload_pos;
+		const void *payload = writer.elided_payload(&payload_size, &payload_pos);
+
+		if (payload_size != record.payload_size)
+			return -1;
+
+		if (marshaler.add_payload(offset + header_size + payload_pos, record.object, payload, payload_size) < 0)
+			return -1;
+	}
+
+	return header_size + writer.stored_size();
+}
+
+// Visits an object for the first time during the traversal.  Returns 1 and
+// sets record->handler if the object needs to be written, and sets
+// handler_ptr if the object's references should be followed.  Returns 0 and
+// the object's mark on later visits, or -1 on error.
+static int marshal_visit_object(ObjectMarshaler &marshaler, PyObject *object, MarshalRecord *record, const TypeHandler **handler_ptr, uint32_t *mark) noexcept
+{
+	*handler_ptr = nullptr;
+	record->object = object;
+	record->handler = nullptr;
+
+	Key remote_key;
+	bool object_changed;
+
+	int ret = marshaler.peer.visit_for_remote(object, &remote_key, &object_changed, mark);
+	if (ret <= 0)
+		return ret;
+
 	const TypeHandler *handler = type_handler_for_object(object);
 
 	if (object_changed) {
-		Py_ssize_t size = handler->marshaled_size(object);
+		Py_ssize_t size = handler->marshaled_size(object, marshaler.version);
 		if (size < 0)
 			return -1;
 
-		auto extent_size = sizeof (ObjectHeader) + size;
-		if (extent_size > 0x7fffffff)
+		if (record_header_bound(marshaler.version) + size > 0x7fffffff)
 			return -1;
 
-		Py_buffer buffer;
-		auto header = extend_and_get_buffer<ObjectHeader>(marshaler.bytearray, extent_size, &buffer);
-		if (header == nullptr)
+		Py_ssize_t payload_size = marshaler.payload_size(object, handler);
+		*record = MarshalRecord { object, handler, remote_key, size, payload_size, false };
+	} else if (marshaler.incremental) {
+		// unchanged objects can't have gained references to new objects
+		return 1;
+	}
+
+	// items stored by value in the record aren't tracked
+	if (handler->by_value && handler->by_value(object, marshaler.version))
+		return 1;
+
+	*handler_ptr = handler;
+	return 1;
+}
+
+static int marshal_write_record(ObjectMarshaler &marshaler, const MarshalRecord &record) noexcept
+{
+	Py_ssize_t bound = marshaler.record_bound(record);
+
+	if (marshaler.presized) {
+		try {
+			marshaler.records.push_back(record);
+		} catch (...) {
 			return -1;
+		}
+
+		marshaler.records_size += bound;
+		return 0;
+	}
+
+	try {
+		marshaler.written.push_back(record.object);
+	} catch (...) {
+		return -1;
+	}
+
+	Py_ssize_t offset = extend_and_get_offset(marshaler.bytearray, bound);
+	if (offset < 0)
+		return -1;
+
+	Py_buffer buffer;
+	auto buf = get_buffer_at<char>(marshaler.bytearray, &buffer, offset);
+	if (buf == nullptr)
+		return -1;
+
+	Py_ssize_t written = write_record(marshaler, record, buf, offset);
+
+	PyBuffer_Release(&buffer);
+
+	if (written < 0)
+		return -1;
+
+	if (written < bound && PyByteArray_Resize(marshaler.bytearray, offset + written) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int marshal_push_object(PyObject *object, void *arg) noexcept
+{
+	auto &stack = *reinterpret_cast<std::vector<PyObject *> *> (arg);
+
+	try {
+		stack.push_back(object);
+	} catch (...) {
+		return -1;
+	}
+
+	return 0;
+}
 
-		header->size = port(int32_t(extent_size));
-		header->type_id = port(handler->type_id);
-		header->key = port(remote_key);
+// Dicts and sets hash their items during initialization.
+static bool marshal_hashing(const TypeHandler *handler) noexcept
+{
+	return handler->type_id == DICT_TYPE_ID ||
+	       handler->type_id == SET_TYPE_ID ||
+	       handler->type_id == FROZENSET_TYPE_ID;
+}
 
-		int ret = handler->marshal(object, header + 1, size, marshaler.peer);
+// While the references of an object are visited in dependency order, the
+// object is marked with its position in the frame stack plus one.
+// Afterwards it's marked as incomplete if it is initialized late by the
+// receiver.
+enum {
+	MARK_INCOMPLETE = 0xffffffff,
+};
 
-		PyBuffer_Release(&buffer);
+static bool marshal_open(const ObjectMarshaler &marshaler, PyObject *object, uint32_t mark) noexcept
+{
+	return mark > 0 && mark <= marshaler.frames.size() && marshaler.frames[mark - 1].record.object == object;
+}
+
+// A record which refers to an object that hasn't been written yet is
+// deferred until the receiver has allocated everything, and so is a hashing
+// record which refers to an object that isn't initialized before it.
+static void marshal_note_reference(MarshalFrame &frame, bool open, bool incomplete) noexcept
+{
+	if (open || (incomplete && frame.hashing))
+		frame.record.deferred = true;
 
+	if (open || incomplete)
+		frame.incomplete = true;
+}
+
+// Writes the record of the innermost object after its references.
+static int marshal_leave_object(ObjectMarshaler &marshaler) noexcept
+{
+	MarshalFrame frame = marshaler.frames.back();
+	bool incomplete = false;
+
+	marshaler.frames.pop_back();
+
+	if (frame.record.handler) {
+		if (marshal_write_record(marshaler, frame.record) < 0)
+			return -1;
+
+		if (frame.incomplete) {
+			marshaler.peer.set_traversal_mark(frame.record.object, MARK_INCOMPLETE);
+			incomplete = true;
+		}
+	}
+
+	if (!marshaler.frames.empty())
+		marshal_note_reference(marshaler.frames.back(), false, incomplete);
+
+	return 0;
+}
+
+// Depth-first walk using the peer's work stack instead of the native stack.
+// Children are pushed in reverse so that records come out in the same
+// preorder as a recursive traversal would produce.  In dependency order
+// (version 2) a record is written after the records of the objects it
+// refers to, except for back-references which make it deferred.  In
+// incremental mode the walk starts from the journaled objects in addition to
+// the root, and stops at unchanged objects.
+static int marshal_visit_objects(ObjectMarshaler &marshaler, PyObject *root) noexcept
+{
+	auto &stack = marshaler.peer.traversal_stack;
+	auto &frames = marshaler.frames;
+	int ret = 0;
+
+	marshaler.peer.begin_traversal();
+	stack.clear();
+	frames.clear();
+
+	if (marshaler.incremental) {
+		if (marshaler.peer.push_journal(stack) < 0)
+			return -1;
+
+		std::reverse(stack.begin(), stack.end());
+	}
+
+	if (marshal_push_object(root, &stack) < 0)
+		return -1;
+
+	while (true) {
+		if (!frames.empty() && stack.size() == frames.back().stack_mark) {
+			ret = marshal_leave_object(marshaler);
+			if (ret < 0)
+				break;
+
+			continue;
+		}
+
+		if (stack.empty())
+			break;
+
+		PyObject *object = stack.back();
+		stack.pop_back();
+
+		MarshalRecord record;
+		const TypeHandler *handler;
+		uint32_t mark = frames.size() + 1;
+
+		int visited = marshal_visit_object(marshaler, object, &record, &handler, &mark);
+		if (visited < 0) {
+			marshaler.peer.mark_unsent(object);
+			ret = -1;
+			break;
+		}
+
+		if (visited == 0) {
+			if (marshaler.ordered && !frames.empty())
+				marshal_note_reference(frames.back(), marshal_open(marshaler, object, mark), mark == MARK_INCOMPLETE);
+
+			continue;
+		}
+
+		if (marshaler.ordered) {
+			try {
+				frames.push_back(MarshalFrame { record, stack.size(), record.handler && marshal_hashing(record.handler), false });
+			} catch (...) {
+				ret = -1;
+				break;
+			}
+		} else if (record.handler) {
+			ret = marshal_write_record(marshaler, record);
+			if (ret < 0)
+				break;
+		}
+
+		if (handler == nullptr)
+			continue;
+
+		auto stack_mark = stack.size();
+
+		ret = handler->traverse(object, marshal_push_object, &stack);
 		if (ret < 0)
+			break;
+
+		std::reverse(stack.begin() + stack_mark, stack.end());
+	}
+
+	stack.clear();
+
+	return ret;
+}
+
+// Writes the records collected in presized mode; offset is the position of
+// buf in the output.  Returns the number of bytes written.
+static Py_ssize_t write_records(ObjectMarshaler &marshaler, char *buf, Py_ssize_t offset) noexcept
+{
+	Py_ssize_t total = 0;
+
+	for (const MarshalRecord &record: marshaler.records) {
+		Py_ssize_t written = write_record(marshaler, record, buf + total, offset + total);
+		if (written < 0)
 			return -1;
+
+		total += written;
 	}
 
-	return handler->traverse(object, marshal_visit_objects, arg);
+	return total;
 }
 
-static int marshal_objects(PeerObject &peer, PyObject *bytearray, PyObject *object) noexcept
+// Writes the records collected in presized mode after resizing the buffer
+// once for all of them, and trims the unused part of the upper bound.
+static int marshal_records(ObjectMarshaler &marshaler) noexcept
+{
+	Py_ssize_t offset = extend_and_get_offset(marshaler.bytearray, marshaler.records_size);
+	if (offset < 0)
+		return -1;
+
+	Py_buffer buffer;
+	auto buf = get_buffer_at<char>(marshaler.bytearray, &buffer, offset);
+	if (buf == nullptr)
+		return -1;
+
+	Py_ssize_t written = write_records(marshaler, buf, offset);
+
+	PyBuffer_Release(&buffer);
+
+	if (written < 0)
+		return -1;
+
+	if (written < marshaler.records_size)
+		return PyByteArray_Resize(marshaler.bytearray, offset + written);
+
+	return 0;
+}
+
+static void write_object_section_header(void *buf, Py_ssize_t section_size, unsigned int version, Key remote_root_key) noexcept
+{
+	auto header = reinterpret_cast<ObjectSectionHeader *> (buf);
+
+	header->section.size = port(int32_t(section_size));
+	header->section.id = port(section_id(OBJECT_SECTION_ID, version));
+	header->root_key = port(remote_root_key);
+}
+
+static int marshal_objects(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags, std::vector<PayloadSegment> *payloads, Py_ssize_t payload_threshold) noexcept
 {
 	Py_ssize_t offset = extend_and_get_offset(bytearray, sizeof (ObjectSectionHeader));
 	if (offset < 0)
 		return -1;
 
+	Py_ssize_t section_size;
+	Key remote_root_key;
+	unsigned int version = peer.wire_version;
+
 	try {
-		ObjectMarshaler marshaler(peer, bytearray);
+		// the first incremental marshal traverses everything and starts the
+		// journal
+		bool incremental = (flags & MARSHAL_INCREMENTAL) && peer.journaling();
+
+		ObjectMarshaler marshaler(peer, bytearray, flags & MARSHAL_PRESIZED, incremental, payloads, payload_threshold);
+
+		// the caller discards the section on error, so nothing is sent
+		if (marshal_visit_objects(marshaler, object) < 0 ||
+		    (marshaler.presized && marshal_records(marshaler) < 0)) {
+			marshaler.unsend();
+			return -1;
+		}
+
+		section_size = PyByteArray_GET_SIZE(bytearray) - offset + marshaler.payloads_size;
+		remote_root_key = peer.key_for_remote(object);
 
-		if (marshal_visit_objects(object, &marshaler) < 0)
+		if (section_size > 0x7fffffff || remote_root_key < 0) {
+			marshaler.unsend();
 			return -1;
+		}
+
+		if ((flags & MARSHAL_INCREMENTAL) || peer.journaling())
+			peer.reset_journal();
 	} catch (...) {
 		return -1;
 	}
 
-	auto section_size = PyByteArray_GET_SIZE(bytearray) - offset;
-	if (section_size > 0x7fffffff)
+	Py_buffer buffer;
+	auto header = get_buffer_at<ObjectSectionHeader>(bytearray, &buffer, offset);
+	if (header == nullptr)
 		return -1;
 
-	Key remote_root_key = peer.key_for_remote(object);
-	if (remote_root_key < 0)
-		return -1;
+	write_object_section_header(header, section_size, version, remote_root_key);
+
+	PyBuffer_Release(&buffer);
+
+	return 0;
+}
+
+// The version section is sent once per peer if negotiation was requested.
+static bool version_section_needed(PeerObject &peer, unsigned int flags) noexcept
+{
+	return (flags & MARSHAL_NEGOTIATE) && !peer.version_offered;
+}
+
+static void write_version_section(void *buf) noexcept
+{
+	auto section = reinterpret_cast<VersionSection *> (buf);
 
+	section->section.size = port(int32_t(sizeof (VersionSection)));
+	section->section.id = port(section_id(FREE_SECTION_ID, 0));
+	section->offer_key = port(VERSION_OFFER_KEY + WIRE_VERSION);
+}
+
+static int marshal_version(PyObject *bytearray) noexcept
+{
 	Py_buffer buffer;
-	auto header = get_buffer_at<ObjectSectionHeader>(bytearray, &buffer, offset);
-	if (header == nullptr)
+	auto section = extend_and_get_buffer<VersionSection>(bytearray, sizeof (VersionSection), &buffer);
+	if (section == nullptr)
 		return -1;
 
-	header->section.size = port(int32_t(section_size));
-	header->section.id = port(int32_t(OBJECT_SECTION_ID));
-	header->root_key = port(remote_root_key);
+	write_version_section(section);
 
 	PyBuffer_Release(&buffer);
 
 	return 0;
 }
 
-static int marshal_freed(PeerObject &peer, PyObject *bytearray) noexcept
+// Upper bound.
+static Py_ssize_t freed_section_size(PeerObject &peer) noexcept
 {
-	auto size = sizeof (SectionHeader) + peer.freed.size() * sizeof (Key);
+	auto size = sizeof (SectionHeader) + peer.freed.size() * wire_key_size(peer.wire_version);
 	if (size > 0x7fffffff)
 		return -1;
 
-	Py_buffer buffer;
-	auto header = extend_and_get_buffer<SectionHeader>(bytearray, size, &buffer);
-	if (header == nullptr)
-		return -1;
+	return size;
+}
+
+// Returns the number of bytes written.
+static Py_ssize_t write_freed(PeerObject &peer, void *buf) noexcept
+{
+	unsigned int version = peer.wire_version;
+	auto header = reinterpret_cast<SectionHeader *> (buf);
+	Writer writer(header + 1, version, 0);
+	Key prev_key = 0;
+
+	for (Key key: peer.freed) {
+		if (version == 0) {
+			writer.key(key);
+		} else {
+			writer.varint(wire_zigzag(key - prev_key));
+			prev_key = key;
+		}
+	}
+
+	Py_ssize_t size = sizeof (SectionHeader) + writer.size();
 
 	header->size = port(int32_t(size));
-	header->id = port(int32_t(FREE_SECTION_ID));
+	header->id = port(section_id(FREE_SECTION_ID, version));
+
+	return size;
+}
+
+static int marshal_freed(PeerObject &peer, PyObject *bytearray) noexcept
+{
+	Py_ssize_t bound = freed_section_size(peer);
+	if (bound < 0)
+		return -1;
 
-	Key *data = reinterpret_cast<Key *> (header + 1);
+	Py_ssize_t offset = extend_and_get_offset(bytearray, bound);
+	if (offset < 0)
+		return -1;
 
-	for (Key key: peer.freed)
-		*data++ = port(key);
+	Py_buffer buffer;
+	auto buf = get_buffer_at<char>(bytearray, &buffer, offset);
+	if (buf == nullptr)
+		return -1;
+
+	Py_ssize_t size = write_freed(peer, buf);
 
 	PyBuffer_Release(&buffer);
 
-	peer.freed.clear();
+	if (size < bound && PyByteArray_Resize(bytearray, offset + size) < 0)
+		return -1;
 
 	return 0;
 }
 
-int marshal(PeerObject &peer, PyObject *bytearray, PyObject *object) noexcept
+static int marshal_sections(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags, std::vector<PayloadSegment> *payloads, Py_ssize_t payload_threshold) noexcept
 {
 	Py_ssize_t orig_size = PyByteArray_GET_SIZE(bytearray);
+	bool offer_version = version_section_needed(peer, flags);
+	size_t freed_count = peer.freed.size();  // more may be freed meanwhile
+
+	if (offer_version && marshal_version(bytearray) < 0)
+		goto fail;
 
 	if (marshal_freed(peer, bytearray) < 0)
 		goto fail;
 
-	if (object && marshal_objects(peer, bytearray, object) < 0)
+	if (object && marshal_objects(peer, bytearray, object, flags, payloads, payload_threshold) < 0)
 		goto fail;
 
+	// the keys are released only if the whole message was marshaled
+	peer.freed.erase(peer.freed.begin(), peer.freed.begin() + freed_count);
+
+	if (offer_version)
+		peer.version_offered = true;
+
 	return 0;
 
 fail:
@@ -200,117 +718,543 @@ fail:
 	return -1;
 }
 
+int marshal(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags) noexcept
+{
+	return marshal_sections(peer, bytearray, object, flags, nullptr, 0);
+}
+
+// Marshals into size bytes of memory at buf.  Returns the size of the
+// message, which has been written only if its upper bound fits; otherwise
+// the bound is returned, the objects remain unsent and the call may be
+// retried with a larger buffer.
+Py_ssize_t marshal_into(PeerObject &peer, void *buf, Py_ssize_t size, PyObject *object, unsigned int flags) noexcept
+{
+	bool offer_version = version_section_needed(peer, flags);
+
+	Py_ssize_t freed_size = freed_section_size(peer);
+	if (freed_size < 0)
+		return -1;
+
+	Py_ssize_t total_size = (offer_version ? sizeof (VersionSection) : 0) + freed_size;
+
+	try {
+		bool incremental = (flags & MARSHAL_INCREMENTAL) && peer.journaling();
+
+		ObjectMarshaler marshaler(peer, nullptr, true, incremental, nullptr, 0);
+		Py_ssize_t section_size = 0;
+
+		if (object) {
+			if (marshal_visit_objects(marshaler, object) < 0) {
+				marshaler.unsend();
+				return -1;
+			}
+
+			section_size = sizeof (ObjectSectionHeader) + marshaler.records_size;
+			if (section_size > 0x7fffffff) {
+				marshaler.unsend();
+				return -1;
+			}
+
+			total_size += section_size;
+		}
+
+		if (total_size > size) {
+			marshaler.unsend();
+			return total_size;
+		}
+
+		auto ptr = reinterpret_cast<char *> (buf);
+
+		if (offer_version) {
+			write_version_section(ptr);
+			ptr += sizeof (VersionSection);
+		}
+
+		ptr += write_freed(peer, ptr);
+
+		if (object) {
+			Py_ssize_t records_size = write_records(marshaler, ptr + sizeof (ObjectSectionHeader), 0);
+			if (records_size < 0) {
+				marshaler.unsend();
+				return -1;
+			}
+
+			section_size = sizeof (ObjectSectionHeader) + records_size;
+			write_object_section_header(ptr, section_size, marshaler.version, peer.key_for_remote(object));
+			ptr += section_size;
+
+			if ((flags & MARSHAL_INCREMENTAL) || peer.journaling())
+				peer.reset_journal();
+		}
+
+		total_size = ptr - reinterpret_cast<char *> (buf);
+	} catch (...) {
+		return -1;
+	}
+
+	peer.freed.clear();
+
+	if (offer_version)
+		peer.version_offered = true;
+
+	return total_size;
+}
+
+static int append_new(PyObject *list, PyObject *item) noexcept
+{
+	if (item == nullptr)
+		return -1;
+
+	int ret = PyList_Append(list, item);
+	Py_DECREF(item);
+	return ret;
+}
+
+// Like marshal, but the data of bytes, str and contiguous buffer objects which
+// is at least threshold bytes long is not copied to the bytearray.  Returns a
+// list of memoryviews which cover the whole bytearray and the left-out data in
+// order.
+PyObject *marshal_segments(PeerObject &peer, PyObject *bytearray, PyObject *object, unsigned int flags, Py_ssize_t threshold) noexcept
+{
+	std::vector<PayloadSegment> payloads;
+
+	if (marshal_sections(peer, bytearray, object, flags, &payloads, threshold) < 0)
+		return nullptr;
+
+	PyObject *list = PyList_New(0);
+	if (list == nullptr)
+		return nullptr;
+
+	PyObject *memoryview = PyMemoryView_FromObject(bytearray);
+	if (memoryview == nullptr)
+		goto fail;
+
+	{
+		Py_ssize_t offset = 0;
+
+		for (const PayloadSegment &payload: payloads) {
+			if (payload.offset > offset && append_new(list, PySequence_GetSlice(memoryview, offset, payload.offset)) < 0)
+				goto fail;
+
+			if (append_new(list, view_memoryview(payload.object, payload.data, payload.size)) < 0)
+				goto fail;
+
+			offset = payload.offset;
+		}
+
+		Py_ssize_t size = PyByteArray_GET_SIZE(bytearray);
+
+		if (size > offset && append_new(list, PySequence_GetSlice(memoryview, offset, size)) < 0)
+			goto fail;
+	}
+
+	Py_DECREF(memoryview);
+	return list;
+
+fail:
+	Py_XDECREF(memoryview);
+	Py_DECREF(list);
+	return nullptr;
+}
+
+static bool read_record_header(Reader &section, Key *prev_key, RecordHeader *header) noexcept
+{
+	if (section.wire_version() == 0) {
+		int32_t size;
+
+		if (!section.int32(&size) || !section.int32(&header->type_id) || !section.key(&header->key))
+			return false;
+
+		header->size = Py_ssize_t(size) - Py_ssize_t(sizeof (ObjectHeader));
+		header->deferred = true;
+	} else {
+		uint64_t type_id;
+		uint64_t key_delta;
+		uint64_t size;
+
+		if (!section.varint(&type_id) || !section.varint(&key_delta) || !section.varint(&size))
+			return false;
+
+		header->deferred = true;
+
+		if (section.wire_version() >= 2) {
+			header->deferred = type_id & 1;
+			type_id >>= 1;
+		}
+
+		if (type_id > 0x7fffffff || size > 0x7fffffff)
+			return false;
+
+		header->type_id = type_id;
+		header->key = *prev_key += wire_unzigzag(key_delta);
+		header->size = size;
+	}
+
+	// immediate values are never sent as records
+	if (key_is_immediate(header->key))
+		return false;
+
+	header->data = section.data(header->size);
+	return header->data != nullptr;
+}
+
+enum {
+	UNMARSHAL_RETAIN_LIMIT = 65536,
+};
+
+// Clears the vector and gives it back to the peer, unless it has grown so
+// large that its memory shouldn't be kept.
+template <typename T>
+static void unmarshal_recycle(std::vector<T> &vector, std::vector<T> &peer_vector) noexcept
+{
+	vector.clear();
+
+	if (vector.capacity() <= UNMARSHAL_RETAIN_LIMIT)
+		vector.swap(peer_vector);
+}
+
+// The vectors are taken from the peer for the duration of the message, so
+// that a nested unmarshal gets its own.
 struct ObjectUnmarshaler {
-	std::unordered_set<PyObject *> pending;
+	PeerObject &peer;
+	std::vector<PyObject *> created;  // new references
+	std::vector<UnmarshalRecord> deferred;
+	unsigned int version;
+	bool ordered;
+	Py_ssize_t max_new_ids;  // no record is smaller than a byte
+
+	ObjectUnmarshaler(PeerObject &peer, unsigned int version):
+		peer(peer),
+		version(version),
+		ordered(version >= 2),
+		max_new_ids(0)
+	{
+		created.swap(peer.unmarshal_created);
+		deferred.swap(peer.unmarshal_deferred);
+	}
 
 	~ObjectUnmarshaler()
 	{
-		for (PyObject *object: pending)
+		for (PyObject *object: created)
 			Py_DECREF(object);
+
+		unmarshal_recycle(created, peer.unmarshal_created);
+		unmarshal_recycle(deferred, peer.unmarshal_deferred);
+
+		peer.release_immediates();
 	}
 
-	int alloc(PeerObject &peer, const void *data, Py_ssize_t size) noexcept
+	// In dependency order the records are allocated and initialized as they
+	// are read, except that deferred records are initialized at the end.  In
+	// older versions all records are deferred, and allocated after reading
+	// the section.
+	int unmarshal(const void *data, Py_ssize_t size) noexcept
 	{
-		while (size >= Py_ssize_t(sizeof (ObjectHeader))) {
-			auto header = reinterpret_cast<const ObjectHeader *> (data);
-			int32_t item_size = port(header->size);
-			int32_t item_type_id = port(header->type_id);
-			Key item_key = port(header->key);
-
-			if (item_size < Py_ssize_t(sizeof (ObjectHeader)) || item_size > size) {
-				fprintf(stderr, "tap unmarshal: header size out of bounds\n");
+		Reader section(data, size, version, 0);
+		Key prev_key = 0;
+
+		max_new_ids = size;
+
+		while (!section.at_end()) {
+			UnmarshalRecord record;
+
+			if (!read_record_header(section, &prev_key, &record.header)) {
+				fprintf(stderr, "tap unmarshal: trailing garbage or truncated data in object section\n");
 				return -1;
 			}
 
-			const TypeHandler *handler = type_handler_for_id(item_type_id);
-			if (handler == nullptr) {
+			record.handler = type_handler_for_id(record.header.type_id);
+			if (record.handler == nullptr) {
 				fprintf(stderr, "tap unmarshal: object type id is unknown\n");
 				return -1;
 			}
 
-			Py_ssize_t marshal_size = item_size - sizeof (ObjectHeader);
-			const void *marshal_data = header + 1;
-
-			PyObject *object = peer.object(item_key);
-			if (object) {
-				if (handler->unmarshal_update == nullptr) {
-					fprintf(stderr, "tap unmarshal: update of immutable object\n");
-					return -1;
-				}
-
-				peer.clear(object);
-			} else {
-				object = handler->unmarshal_alloc(marshal_data, marshal_size, peer);
-				if (object == nullptr) {
-					fprintf(stderr, "tap unmarshal: allocation failed (type_id=%d)\n", item_type_id);
-					return -1;
-				}
+			if (ordered && alloc(record) < 0)
+				return -1;
 
+			if (record.header.deferred) {
 				try {
-					pending.insert(object);
+					deferred.push_back(record);
 				} catch (...) {
 					return -1;
 				}
-
-				peer.insert(object, item_key);
+			} else if (init(record) < 0) {
+				return -1;
 			}
-
-			data = reinterpret_cast<const char *> (data) + item_size;
-			size -= item_size;
 		}
 
-		if (size > 0) {
-			fprintf(stderr, "tap unmarshal: trailing garbage or truncated data in object section\n");
+		if (!ordered && (alloc_deferred(true) < 0 || alloc_deferred(false) < 0))
 			return -1;
+
+		if (init_objects() < 0 || init_hashing() < 0)
+			return -1;
+
+		return 0;
+	}
+
+	int alloc(UnmarshalRecord &record) noexcept
+	{
+		const RecordHeader &header = record.header;
+		PyObject *object = peer.object(header.key);
+
+		if (object) {
+			if (record.handler->unmarshal_update == nullptr) {
+				fprintf(stderr, "tap unmarshal: update of immutable object\n");
+				return -1;
+			}
+
+			peer.clear(object);
+			record.created = false;
+		} else {
+			Reader reader(header.data, header.size, version, header.key);
+
+			object = record.handler->unmarshal_alloc(reader, peer);
+			if (object == nullptr) {
+				fprintf(stderr, "tap unmarshal: allocation failed (type_id=%d)\n", header.type_id);
+				return -1;
+			}
+
+			try {
+				created.push_back(object);
+			} catch (...) {
+				Py_DECREF(object);
+				return -1;
+			}
+
+			if (peer.insert_received(object, header.key, max_new_ids) < 0)
+				return -1;
+
+			record.created = true;
 		}
 
+		record.object = object;
+		return 0;
+	}
+
+	// Type objects are allocated first, since instances of classes need
+	// them.
+	int alloc_deferred(bool types) noexcept
+	{
+		for (UnmarshalRecord &record: deferred)
+			if ((record.header.type_id == TYPE_TYPE_ID) == types && alloc(record) < 0)
+				return -1;
+
+		return 0;
+	}
+
+	// Dicts and sets hash their items, so they are initialized after the
+	// other objects.
+	static bool hashing(PyObject *object) noexcept
+	{
+		return PyDict_Check(object) || PyAnySet_Check(object);
+	}
+
+	int init_objects() noexcept
+	{
+		for (const UnmarshalRecord &record: deferred)
+			if (!hashing(record.object) && init(record) < 0)
+				return -1;
+
 		return 0;
 	}
 
-	int init(PeerObject &peer, const void *data, Py_ssize_t size, bool init_dicts) noexcept
+	// A hash may depend on the contents of any object which the hashed
+	// object refers to: nested frozensets, or the dicts of instances with a
+	// __hash__ method.  A dict or set is filled after the objects which it
+	// hashes are ready, i.e. filled along with everything they refer to,
+	// depth first among the deferred records and the other new objects.  A
+	// reference back to an object which is still being made ready is a
+	// cycle, which is ignored; a hash which depends on itself that way may
+	// see an empty object.
+	enum ReadyState: uint8_t {
+		READY_PENDING,
+		READY_ACTIVE,
+		READY_DONE,
+	};
+
+	struct ReadyEntry {
+		size_t index;  // of the deferred record, or NO_RECORD
+		ReadyState fill;
+		ReadyState deep;
+	};
+
+	struct ReadyFrame {
+		PyObject *object;
+		bool deep;
+		bool expanded;
+	};
+
+	struct ReadyVisit {
+		PointerTable<ReadyEntry> &entries;
+		std::vector<ReadyFrame> &stack;
+	};
+
+	static const size_t NO_RECORD = SIZE_MAX;
+
+	int init_hashing() noexcept
 	{
-		while (size >= Py_ssize_t(sizeof (ObjectHeader))) {
-			auto header = reinterpret_cast<const ObjectHeader *> (data);
-			int32_t item_size = port(header->size);
-			int32_t item_type_id = port(header->type_id);
-			Key item_key = port(header->key);
+		bool any = false;
 
-			const TypeHandler *handler = type_handler_for_id(item_type_id);
+		for (const UnmarshalRecord &record: deferred)
+			if (hashing(record.object))
+				any = true;
 
-			Py_ssize_t marshal_size = item_size - sizeof (ObjectHeader);
-			const void *marshal_data = header + 1;
+		if (!any)
+			return 0;
 
-			PyObject *object = peer.object(item_key);
+		try {
+			PointerTable<ReadyEntry> entries;
+			std::vector<ReadyFrame> stack;
+			ReadyVisit visit { entries, stack };
 
-			if (!PyDict_Check(object) == !init_dicts) {
-				int ret;
+			for (PyObject *object: created)
+				*entries.insert(object) = ReadyEntry { NO_RECORD, READY_DONE, READY_PENDING };
 
-				if (pending.find(object) != pending.end())
-					ret = handler->unmarshal_init(object, marshal_data, marshal_size, peer);
-				else
-					ret = handler->unmarshal_update(object, marshal_data, marshal_size, peer);
+			for (size_t i = 0; i < deferred.size(); ++i) {
+				ReadyState fill = hashing(deferred[i].object) ? READY_PENDING : READY_DONE;
+				*entries.insert(deferred[i].object) = ReadyEntry { i, fill, READY_PENDING };
+			}
 
-				if (ret < 0) {
-					fprintf(stderr, "tap unmarshal: type handler failed to unmarshal: %s\n", object->ob_type->tp_name);
-					return -1;
+			for (const UnmarshalRecord &record: deferred) {
+				if (!hashing(record.object))
+					continue;
+
+				stack.push_back(ReadyFrame { record.object, false, false });
+
+				while (!stack.empty()) {
+					ReadyFrame frame = stack.back();
+					stack.pop_back();
+
+					ReadyEntry *entry = entries.find(frame.object);
+
+					if (!frame.deep) {
+						if (frame.expanded) {
+							entry->fill = READY_DONE;
+
+							if (init(deferred[entry->index]) < 0)
+								return -1;
+						} else if (entry->fill == READY_PENDING) {
+							entry->fill = READY_ACTIVE;
+							stack.push_back(ReadyFrame { frame.object, false, true });
+
+							if (record_references(deferred[entry->index], false, visit) < 0)
+								return -1;
+						}
+					} else if (frame.expanded) {
+						entry->deep = READY_DONE;
+					} else if (entry->deep == READY_PENDING) {
+						if (entry->fill == READY_PENDING) {
+							stack.push_back(ReadyFrame { frame.object, true, false });
+							stack.push_back(ReadyFrame { frame.object, false, false });
+							continue;
+						}
+
+						entry->deep = READY_ACTIVE;
+						stack.push_back(ReadyFrame { frame.object, true, true });
+
+						if (object_references(frame.object, *entry, visit) < 0)
+							return -1;
+					}
 				}
 			}
+		} catch (...) {
+			return -1;
+		}
 
-			data = reinterpret_cast<const char *> (data) + item_size;
-			size -= item_size;
+		return 0;
+	}
+
+	static int ready_visit(PyObject *object, void *arg) noexcept
+	{
+		auto visit = reinterpret_cast<ReadyVisit *> (arg);
+		ReadyEntry *entry = visit->entries.find(object);
+
+		if (entry && entry->deep == READY_PENDING) {
+			try {
+				visit->stack.push_back(ReadyFrame { object, true, false });
+			} catch (...) {
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	// Visits the objects which a dict, set or frozenset record refers to:
+	// only the hashed ones, or also the values of a dict.
+	int record_references(const UnmarshalRecord &record, bool values, ReadyVisit &visit) noexcept
+	{
+		const RecordHeader &header = record.header;
+		Reader reader(header.data, header.size, version, header.key);
+		bool dict = PyDict_Check(record.object);
+		Py_ssize_t length;
+
+		if (!reader.length(sizeof (Key) * (dict ? 2 : 1), &length))
+			return -1;
+
+		for (Py_ssize_t i = 0; i < length * (dict ? 2 : 1); ++i) {
+			Key key;
+
+			if (!reader.key(&key))
+				return -1;
+
+			if (dict && (i & 1) && !values)
+				continue;
+
+			PyObject *object = peer.object(key);
+			if (object && ready_visit(object, &visit) < 0)
+				return -1;
 		}
 
 		return 0;
 	}
 
-	void finalize(PeerObject &peer) noexcept
+	// Filled objects are traversed; the records of the others are read.
+	int object_references(PyObject *object, const ReadyEntry &entry, ReadyVisit &visit) noexcept
 	{
-		peer.set_references(pending);
-		pending.clear();
+		if (entry.index == NO_RECORD)
+			return type_handler_for_object(object)->traverse(object, ready_visit, &visit);
+
+		const UnmarshalRecord &record = deferred[entry.index];
+
+		if (entry.fill != READY_DONE)
+			return record_references(record, true, visit);
+
+		return record.handler->traverse(object, ready_visit, &visit);
+	}
+
+	int init(const UnmarshalRecord &record) noexcept
+	{
+		const RecordHeader &header = record.header;
+		Reader reader(header.data, header.size, version, header.key);
+		int ret;
+
+		if (record.created)
+			ret = record.handler->unmarshal_init(record.object, reader, peer);
+		else
+			ret = record.handler->unmarshal_update(record.object, reader, peer);
+
+		if (ret < 0) {
+			fprintf(stderr, "tap unmarshal: type handler failed to unmarshal: %s\n", record.object->ob_type->tp_name);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	PyObject *finalize(Key root_key) noexcept
+	{
+		peer.set_references(created);
+		created.clear();
+
+		PyObject *root = peer.object(root_key);
+		Py_XINCREF(root);
+
+		return root;
 	}
 };
 
-static PyObject *unmarshal_objects(PeerObject &peer, const void *data, Py_ssize_t size) noexcept
+static PyObject *unmarshal_objects(PeerObject &peer, const void *data, Py_ssize_t size, unsigned int version) noexcept
 {
 	if (size < Py_ssize_t(sizeof (ObjectSectionHeader))) {
 		fprintf(stderr, "tap unmarshal: not enough data in object section\n");
@@ -324,40 +1268,48 @@ static PyObject *unmarshal_objects(PeerObject &peer, const void *data, Py_ssize_
 	size -= sizeof (ObjectSectionHeader);
 
 	try {
-		ObjectUnmarshaler unmarshaler;
+		ObjectUnmarshaler unmarshaler(peer, version);
 
-		if (unmarshaler.alloc(peer, data, size) < 0)
+		if (unmarshaler.unmarshal(data, size) < 0)
 			return nullptr;
 
-		if (unmarshaler.init(peer, data, size, false) < 0 || unmarshaler.init(peer, data, size, true) < 0)
-			return nullptr;
-
-		unmarshaler.finalize(peer);
+		return unmarshaler.finalize(root_key);
 	} catch (...) {
 		return nullptr;
 	}
-
-	auto root = peer.object(root_key);
-	Py_XINCREF(root);
-
-	return root;
 }
 
-static int unmarshal_freed(PeerObject &peer, const void *data, Py_ssize_t size) noexcept
+static int unmarshal_freed(PeerObject &peer, const void *data, Py_ssize_t size, unsigned int version) noexcept
 {
-	data = reinterpret_cast<const char *> (data) + sizeof (SectionHeader);
-	size -= sizeof (SectionHeader);
+	Reader reader(reinterpret_cast<const char *> (data) + sizeof (SectionHeader), size - sizeof (SectionHeader), version, 0);
+	Key prev_key = 0;
 
-	if ((size % sizeof (Key)) != 0) {
+	if (version == 0 && reader.remaining() % sizeof (Key)) {
 		fprintf(stderr, "tap unmarshal: trailing garbage or truncated data in freed section\n");
 		return -1;
 	}
 
-	const Key *portable = reinterpret_cast<const Key *> (data);
-	int count = size / sizeof (Key);
+	while (!reader.at_end()) {
+		Key key;
+
+		if (version == 0) {
+			if (!reader.key(&key))
+				return -1;
 
-	for (int i = 0; i < count; i++) {
-		Key key = port(portable[i]);
+			if (key <= VERSION_OFFER_LIMIT) {
+				peer.wire_version = std::min(unsigned(WIRE_VERSION), unsigned(key - VERSION_OFFER_KEY));
+				continue;
+			}
+		} else {
+			uint64_t delta;
+
+			if (!reader.varint(&delta)) {
+				fprintf(stderr, "tap unmarshal: truncated or malformed data in freed section\n");
+				return -1;
+			}
+
+			key = prev_key += wire_unzigzag(delta);
+		}
 
 		fprintf(stderr, "tap unmarshal: object with key %ld dereference\n", key);
 
@@ -367,32 +1319,41 @@ static int unmarshal_freed(PeerObject &peer, const void *data, Py_ssize_t size)
 	return 0;
 }
 
-PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size) noexcept
+PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size, PyObject *owner) noexcept
 {
 	PyObject *root = nullptr;
+	PyObject *outer_owner = peer.unmarshal_owner;
+
+	peer.unmarshal_owner = owner;
 
 	while (size >= Py_ssize_t(sizeof (SectionHeader))) {
 		auto header = reinterpret_cast<const SectionHeader *> (data);
 		auto section_size = port(header->size);
-		auto section_id = port(header->id);
+		auto section_id = uint32_t(port(header->id));
+		unsigned int version = section_id >> 8;
 
 		if (section_size < Py_ssize_t(sizeof (SectionHeader)) || section_size > size) {
 			fprintf(stderr, "tap unmarshal: section size out of bounds\n");
 			goto fail;
 		}
 
-		switch (SectionId(section_id)) {
+		if (version > WIRE_VERSION) {
+			fprintf(stderr, "tap unmarshal: unsupported wire version: %u\n", version);
+			goto fail;
+		}
+
+		switch (SectionId(section_id & 0xff)) {
 		case OBJECT_SECTION_ID:
 			Py_XDECREF(root);
 
-			root = unmarshal_objects(peer, data, section_size);
+			root = unmarshal_objects(peer, data, section_size, version);
 			if (root == nullptr)
 				goto fail;
 
 			break;
 
 		case FREE_SECTION_ID:
-			if (unmarshal_freed(peer, data, section_size) < 0)
+			if (unmarshal_freed(peer, data, section_size, version) < 0)
 				goto fail;
 
 			if (root == nullptr) {
@@ -403,7 +1364,7 @@ PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size) noexcep
 			break;
 
 		default:
-			fprintf(stderr, "tap unmarshal: unknown section id: %d\n", section_id);
+			fprintf(stderr, "tap unmarshal: unknown section id: %u\n", section_id);
 			goto fail;
 		}
 
@@ -416,9 +1377,11 @@ PyObject *unmarshal(PeerObject &peer, const void *data, Py_ssize_t size) noexcep
 		goto fail;
 	}
 
+	peer.unmarshal_owner = outer_owner;
 	return root;
 
 fail:
+	peer.unmarshal_owner = outer_owner;
 	Py_XDECREF(root);
 	return nullptr;
 }
@@ -15,20 +15,6 @@ typedef struct {
 
 namespace tap {
 
-struct Portable {
-	Key dict;
-
-	const char *name() const noexcept
-	{
-		return reinterpret_cast<const char *> (this + 1);
-	}
-
-	char *name() noexcept
-	{
-		return reinterpret_cast<char *> (this + 1);
-	}
-} TAP_PACKED;
-
 static int module_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	Py_VISIT(PyModule_GetDict(object));
@@ -36,12 +22,12 @@ static int module_traverse(PyObject *object, visitproc visit, void *arg) noexcep
 	return 0;
 }
 
-static Py_ssize_t module_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t module_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	return sizeof (Portable) + strlen(PyModule_GetName(object));
+	return wire_key_size(version) + strlen(PyModule_GetName(object));
 }
 
-static int module_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int module_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	Key dict_rk = peer.key_for_remote(PyModule_GetDict(object));
 	if (dict_rk < 0)
@@ -49,22 +35,22 @@ static int module_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObje
 
 	const char *name = PyModule_GetName(object);
 
-	Portable *portable = reinterpret_cast<Portable *> (buf);
-
-	portable->dict = port(dict_rk);
-	memcpy(portable->name(), name, strlen(name));
+	writer.key(dict_rk);
+	writer.data(name, strlen(name));
 
 	return 0;
 }
 
-static PyObject *module_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *module_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size <= Py_ssize_t(sizeof (Portable)))
+	Key dict_key;
+
+	if (!reader.key(&dict_key) || reader.at_end())
 		return nullptr;
 
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
+	Py_ssize_t name_size = reader.remaining();
 
-	PyObject *name = PyUnicode_FromStringAndSize(portable->name(), size - sizeof (Portable));
+	PyObject *name = PyUnicode_FromStringAndSize(reinterpret_cast<const char *> (reader.data(name_size)), name_size);
 	if (name == nullptr)
 		return nullptr;
 
@@ -74,12 +60,15 @@ static PyObject *module_unmarshal_alloc(const void *data, Py_ssize_t size, PeerO
 	return object;
 }
 
-static int module_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int module_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	PyModuleObject *module = reinterpret_cast<PyModuleObject *> (object);
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
+	Key dict_key;
+
+	if (!reader.key(&dict_key))
+		return -1;
 
-	PyObject *new_dict = peer.object(port(portable->dict));
+	PyObject *new_dict = peer.object(dict_key);
 	if (new_dict == nullptr)
 		return -1;
 
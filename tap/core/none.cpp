@@ -7,22 +7,22 @@ static int none_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t none_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t none_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	return 0;
 }
 
-static int none_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int none_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	return 0;
 }
 
-static PyObject *none_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *none_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
 	Py_RETURN_NONE;
 }
 
-static int none_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int none_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -0,0 +1,362 @@
+#include "core.hpp"
+
+#include <structmember.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace tap {
+
+// Attribute assignments go through tp_setattro, which is wrapped for each
+// class whose instances are marshaled or unmarshaled.  The original functions
+// are looked up in the method resolution order, since subclasses created later
+// inherit the wrapper from the first class in it which has one.  Wrapped
+// classes are kept alive so that the entries stay valid.
+static setattrofunc object_setattro_orig(PyTypeObject *type) noexcept
+{
+	auto &origs = instance_object_setattros();
+	PyObject *mro = type->tp_mro;
+
+	for (Py_ssize_t i = 0; mro && i < PyTuple_GET_SIZE(mro); ++i) {
+		setattrofunc *orig = origs.find(reinterpret_cast<PyTypeObject *> (PyTuple_GET_ITEM(mro, i)));
+		if (orig)
+			return *orig;
+	}
+
+	return PyObject_GenericSetAttr;
+}
+
+static int object_setattro(PyObject *object, PyObject *name, PyObject *value) noexcept
+{
+	int ret = object_setattro_orig(Py_TYPE(object))(object, name, value);
+	if (ret == 0) {
+		peers_touch(object);
+
+		PyObject **dictptr = _PyObject_GetDictPtr(object);
+		if (dictptr && *dictptr)
+			peers_touch(*dictptr);
+	}
+
+	return ret;
+}
+
+// Assigning __setattr__ to a class replaces the wrapper.  It is reinstalled
+// when an instance is marshaled or unmarshaled again, but attribute
+// assignments made in between aren't noticed by incremental marshaling.
+static int object_track(PyTypeObject *type) noexcept
+{
+	if (type->tp_setattro == object_setattro)
+		return 0;
+
+	auto &origs = instance_object_setattros();
+	bool tracked = origs.find(type) != nullptr;
+
+	try {
+		*origs.insert(type) = type->tp_setattro;
+	} catch (...) {
+		return -1;
+	}
+
+	if (!tracked)
+		Py_INCREF(type);
+
+	type->tp_setattro = object_setattro;
+	return 0;
+}
+
+// Classes defined in Python on top of object, so that instances consist of
+// the dict and slot values.
+bool object_check(PyTypeObject *type) noexcept
+{
+	if (type == &PyBaseObject_Type)
+		return false;
+
+	for (; type != &PyBaseObject_Type; type = type->tp_base) {
+		if (type == nullptr ||
+		    !(type->tp_flags & Py_TPFLAGS_HEAPTYPE) ||
+		    type->tp_itemsize ||
+		    Py_TYPE(type) != &PyType_Type)
+			return false;
+	}
+
+	return true;
+}
+
+// Returns "module:qualname" encoded as UTF-8.
+PyObject *object_class_name(PyTypeObject *type) noexcept
+{
+	PyObject *module = PyDict_GetItemString(type->tp_dict, "__module__");
+	PyObject *qualname = reinterpret_cast<PyHeapTypeObject *> (type)->ht_qualname;
+
+	if (module == nullptr || !PyUnicode_Check(module) || qualname == nullptr) {
+		fprintf(stderr, "tap object marshal: class %s has no module or qualified name\n", type->tp_name);
+		return nullptr;
+	}
+
+	PyObject *name = PyUnicode_FromFormat("%U:%U", module, qualname);
+	if (name == nullptr)
+		return nullptr;
+
+	PyObject *bytes = PyUnicode_AsUTF8String(name);
+	Py_DECREF(name);
+	return bytes;
+}
+
+// Imports the class, or returns the opaque type for the class name if it
+// can't be imported.
+PyTypeObject *object_class_for_name(const char *data, Py_ssize_t size) noexcept
+{
+	const char *colon = reinterpret_cast<const char *> (memchr(data, ':', size));
+	if (colon == nullptr)
+		return nullptr;
+
+	PyObject *object = nullptr;
+
+	try {
+		const std::string module_name(data, colon - data);
+		const std::string qualname(colon + 1, data + size);
+
+		object = PyImport_ImportModule(module_name.c_str());
+
+		for (size_t begin = 0; object && begin <= qualname.size(); ) {
+			size_t end = qualname.find('.', begin);
+			if (end == std::string::npos)
+				end = qualname.size();
+
+			PyObject *attr = PyObject_GetAttrString(object, qualname.substr(begin, end - begin).c_str());
+			Py_DECREF(object);
+			object = attr;
+			begin = end + 1;
+		}
+
+		if (object && PyType_Check(object) && object_check(reinterpret_cast<PyTypeObject *> (object)))
+			return reinterpret_cast<PyTypeObject *> (object);
+
+		Py_XDECREF(object);
+		PyErr_Clear();
+
+		PyTypeObject *type = opaque_type_for_name(qualname.substr(qualname.rfind('.') + 1));
+		Py_XINCREF(type);
+		return type;
+	} catch (...) {
+		Py_XDECREF(object);
+		return nullptr;
+	}
+}
+
+// Calls func with the slot value pointers of the class and its bases.
+template <typename Func>
+static void object_slots(PyObject *object, Func func) noexcept
+{
+	for (PyTypeObject *type = Py_TYPE(object); type != &PyBaseObject_Type; type = type->tp_base) {
+		for (PyMemberDef *member = type->tp_members; member && member->name; ++member) {
+			if (member->type == T_OBJECT_EX)
+				func(reinterpret_cast<PyObject **> (reinterpret_cast<char *> (object) + member->offset));
+		}
+	}
+}
+
+static Py_ssize_t object_slot_count(PyObject *object) noexcept
+{
+	Py_ssize_t count = 0;
+
+	object_slots(object, [&](PyObject **slot) {
+		count++;
+	});
+
+	return count;
+}
+
+static PyObject *object_dict(PyObject *object) noexcept
+{
+	PyObject **dictptr = _PyObject_GetDictPtr(object);
+	return dictptr ? *dictptr : nullptr;
+}
+
+static int object_traverse(PyObject *object, visitproc visit, void *arg) noexcept
+{
+	Py_VISIT(Py_TYPE(object));
+	Py_VISIT(object_dict(object));
+
+	int ret = 0;
+
+	object_slots(object, [&](PyObject **slot) {
+		if (ret == 0 && *slot)
+			ret = visit(*slot, arg);
+	});
+
+	return ret;
+}
+
+static Py_ssize_t object_marshaled_size(PyObject *object, unsigned int version) noexcept
+{
+	return wire_key_size(version) * (2 + object_slot_count(object)) + wire_length_size(version);
+}
+
+static int object_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	if (object_track(Py_TYPE(object)) < 0)
+		return -1;
+
+	Key type_key = peer.key_for_remote(reinterpret_cast<PyObject *> (Py_TYPE(object)));
+	if (type_key < 0)
+		return -1;
+
+	Key dict_key = -1;
+	PyObject *dict = object_dict(object);
+
+	if (dict) {
+		dict_key = peer.key_for_remote(dict);
+		if (dict_key < 0)
+			return -1;
+	}
+
+	Py_ssize_t count = object_slot_count(object);
+
+	writer.key(type_key);
+	writer.key(dict_key);
+	writer.length(count);
+
+	int ret = 0;
+
+	object_slots(object, [&](PyObject **slot) {
+		Key key = -1;
+
+		if (ret == 0 && *slot) {
+			key = peer.key_for_remote(*slot);
+			if (key < 0)
+				ret = -1;
+		}
+
+		writer.key(key);
+	});
+
+	return ret;
+}
+
+// Instances of classes which couldn't be imported are opaque.
+static PyObject *object_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Key type_key;
+
+	if (!reader.key(&type_key))
+		return nullptr;
+
+	PyObject *type_object = peer.object(type_key);
+	if (type_object == nullptr || !PyType_Check(type_object))
+		return nullptr;
+
+	PyTypeObject *type = reinterpret_cast<PyTypeObject *> (type_object);
+
+	if (object_check(type)) {
+		if (object_track(type) < 0)
+			return nullptr;
+	} else if (!opaque_type_check(type)) {
+		return nullptr;
+	}
+
+	return type->tp_alloc(type, 0);
+}
+
+// The class may have been assigned on the other side.  Assigning __class__
+// checks that the layouts are compatible.
+static int object_set_class(PyObject *object, PyTypeObject *type) noexcept
+{
+	if (!object_check(type) || object_track(type) < 0)
+		return -1;
+
+	PyObject *name = PyUnicode_FromString("__class__");
+	if (name == nullptr)
+		return -1;
+
+	int ret = PyObject_GenericSetAttr(object, name, reinterpret_cast<PyObject *> (type));
+	Py_DECREF(name);
+	return ret;
+}
+
+// Opaque instances stay opaque.
+static int object_unmarshal_update(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	Key type_key;
+	Key dict_key;
+
+	if (!reader.key(&type_key) || !reader.key(&dict_key))
+		return -1;
+
+	PyObject *type = peer.object(type_key);
+	if (type == nullptr || !PyType_Check(type))
+		return -1;
+
+	if (opaque_type_check(Py_TYPE(object)))
+		return 0;
+
+	if (type != reinterpret_cast<PyObject *> (Py_TYPE(object)) &&
+	    object_set_class(object, reinterpret_cast<PyTypeObject *> (type)) < 0)
+		return -1;
+
+	PyObject **dictptr = _PyObject_GetDictPtr(object);
+	PyObject *dict = nullptr;
+
+	if (dict_key >= 0) {
+		dict = peer.object(dict_key);
+		if (dict == nullptr || !PyDict_CheckExact(dict) || dictptr == nullptr)
+			return -1;
+	}
+
+	Py_ssize_t count = object_slot_count(object);
+
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key), &length) || length != count)
+		return -1;
+
+	// the values are read before anything is replaced
+	std::vector<PyObject *> values;
+
+	try {
+		values.resize(count);
+	} catch (...) {
+		return -1;
+	}
+
+	for (PyObject *&value: values) {
+		Key key;
+
+		if (!reader.key(&key))
+			return -1;
+
+		if (key >= 0) {
+			value = peer.object(key);
+			if (value == nullptr)
+				return -1;
+		}
+	}
+
+	if (dictptr) {
+		Py_XINCREF(dict);
+		Py_XSETREF(*dictptr, dict);
+	}
+
+	auto value = values.begin();
+
+	object_slots(object, [&](PyObject **slot) {
+		Py_XINCREF(*value);
+		Py_XSETREF(*slot, *value);
+		++value;
+	});
+
+	return 0;
+}
+
+const TypeHandler object_type_handler = {
+	OBJECT_TYPE_ID,
+	object_traverse,
+	object_marshaled_size,
+	object_marshal,
+	object_unmarshal_alloc,
+	object_unmarshal_update,
+	object_unmarshal_update,
+};
+
+} // namespace tap
@@ -84,29 +84,35 @@ PyTypeObject *opaque_type_for_name(const std::string &name) noexcept
 	return type;
 }
 
+bool opaque_type_check(PyTypeObject *type) noexcept
+{
+	return type->tp_new == opaque_new;
+}
+
 static int opaque_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	return 0;
 }
 
-static Py_ssize_t opaque_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t opaque_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	return strlen(Py_TYPE(object)->tp_name);
 }
 
-static int opaque_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int opaque_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
 	const char *name = Py_TYPE(object)->tp_name;
-	memcpy(buf, name, strlen(name));
+	writer.data(name, strlen(name));
 	return 0;
 }
 
-static PyObject *opaque_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *opaque_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
+	Py_ssize_t size = reader.remaining();
 	if (size == 0)
 		return nullptr;
 
-	auto text = reinterpret_cast <const char *> (data);
+	auto text = reinterpret_cast <const char *> (reader.data(size));
 
 	for (int i = 0; i < size; i++) {
 		if (text[i] == '\0')
@@ -131,7 +137,7 @@ static PyObject *opaque_unmarshal_alloc(const void *data, Py_ssize_t size, PeerO
 	return type->tp_alloc(type, 0);
 }
 
-static int opaque_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int opaque_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -6,29 +6,29 @@ namespace tap {
 
 struct PeerObject::State {
 	enum {
-		DIRTY_FLAG     = 1 << 0,
-		REFERENCE_FLAG = 1 << 1,
+		REFERENCE_FLAG = 1 << 0,
 	};
 
 	State() noexcept:
 		key(-1),
-		flags(0)
+		flags(0),
+		index_id(-1),
+		traversal(0),
+		mark(0),
+		sent_epoch(0)
 	{
 	}
 
-	State(Key key, unsigned int flags) noexcept:
+	State(Key key, int32_t index_id, uint64_t sent_epoch) noexcept:
 		key(key),
-		flags(flags)
+		flags(0),
+		index_id(index_id),
+		traversal(0),
+		mark(0),
+		sent_epoch(sent_epoch)
 	{
 	}
 
-	State &operator=(const State &other) noexcept
-	{
-		key = other.key;
-		flags = other.flags;
-		return *this;
-	}
-
 	void set_flag(unsigned int mask) noexcept
 	{
 		flags |= mask;
@@ -44,54 +44,149 @@ struct PeerObject::State {
 		return flags & mask;
 	}
 
+	// The object has been modified after it was last sent (or received).
+	bool changed(const ObjectIndex &index) const noexcept
+	{
+		return index.modified(index_id) > sent_epoch;
+	}
+
 	Key key;
 	unsigned int flags;
+	int32_t index_id;
+	uint32_t traversal;  // generation of the marshal which last visited this
+	uint32_t mark;       // set by that marshal
+	uint64_t sent_epoch;
 };
 
-PeerObject::PeerObject():
-	next_object_id(0)
+// Immediate key payload: the value shifted left by two bits, and the kind.
+enum ImmediateKind {
+	IMMEDIATE_CONSTANT,
+	IMMEDIATE_INT,
+};
+
+enum ImmediateConstant {
+	IMMEDIATE_NONE = 1,
+	IMMEDIATE_FALSE,
+	IMMEDIATE_TRUE,
+};
+
+const long long IMMEDIATE_INT_LIMIT = 1LL << 58;
+
+static Key make_immediate_key(uint64_t value, ImmediateKind kind) noexcept
 {
-	instance_peers().insert(this);
+	return IMMEDIATE_KEY_FLAG | Key((value << 2) | kind);
 }
 
-PeerObject::~PeerObject()
+// Returns the immediate key which stands for the object, or -1.
+static Key immediate_key(PyObject *object) noexcept
 {
-	instance_peers().erase(this);
+	if (object == Py_None)
+		return make_immediate_key(IMMEDIATE_NONE, IMMEDIATE_CONSTANT);
+
+	if (object == Py_False)
+		return make_immediate_key(IMMEDIATE_FALSE, IMMEDIATE_CONSTANT);
+
+	if (object == Py_True)
+		return make_immediate_key(IMMEDIATE_TRUE, IMMEDIATE_CONSTANT);
+
+	if (Py_TYPE(object) == &PyLong_Type) {
+		int overflow;
+		long long value = PyLong_AsLongLongAndOverflow(object, &overflow);
 
-	for (auto pair: states) {
-		if (pair.second.test_flag(State::REFERENCE_FLAG))
-			Py_DECREF(pair.first);
+		if (overflow == 0 && value > -IMMEDIATE_INT_LIMIT && value < IMMEDIATE_INT_LIMIT)
+			return make_immediate_key(wire_zigzag(value), IMMEDIATE_INT);
 	}
+
+	return -1;
 }
 
-int PeerObject::insert(PyObject *object, Key key) noexcept
+PeerObject::PeerObject():
+	wire_version(0),
+	version_offered(false),
+	view_threshold(0),
+	unmarshal_owner(nullptr),
+	next_object_id(0),
+	traversal(0),
+	journal_epoch(0)
 {
-	return insert(object, key, 0);
 }
 
-int PeerObject::insert(PyObject *object, Key key, unsigned int flags) noexcept
+PeerObject::~PeerObject()
 {
-	try {
-		states[object] = State(key, flags);
-	} catch (...) {
+	auto &index = instance_index();
+
+	states.for_each([this, &index](void *ptr, State &state) {
+		index.unsubscribe(reinterpret_cast<PyObject *> (ptr), this);
+	});
+
+	states.for_each([](void *ptr, State &state) {
+		if (state.test_flag(State::REFERENCE_FLAG))
+			Py_DECREF(reinterpret_cast<PyObject *> (ptr));
+	});
+
+	release_immediates();
+}
+
+const size_t UNSENT_ID_SLACK = 65536;
+
+// Keys are allocated sequentially, so a received key may exceed the known
+// ones by at most the number of new objects (new_ids), and by the ids of
+// objects which the remote peer failed to send.  Others are rejected instead
+// of growing the table to an arbitrary size.
+int PeerObject::insert_received(PyObject *object, Key key, Py_ssize_t new_ids) noexcept
+{
+	uint32_t object_id = key;
+	uint32_t remote_id = key >> 32;
+
+	if (remote_id > 1 || object_id > objects[remote_id].size() + new_ids + UNSENT_ID_SLACK) {
+		fprintf(stderr, "tap peer: received key %ld is out of range\n", key);
 		return -1;
 	}
 
+	return insert(object, key, instance_index().epoch());
+}
+
+int PeerObject::insert(PyObject *object, Key key, uint64_t sent_epoch) noexcept
+{
+	uint32_t object_id = key;
+	uint32_t remote_id = key >> 32;
+
+	if (remote_id > 1)
+		return -1;
+
+	auto &vector = objects[remote_id];
+	auto &index = instance_index();
+
+	int32_t index_id = index.subscribe(object, this);
+	if (index_id < 0)
+		return -1;
+
 	try {
-		objects[key] = object;
+		if (object_id >= vector.size())
+			vector.resize(Key(object_id) + 1, nullptr);
+
+		*states.insert(object) = State(key, index_id, sent_epoch);
 	} catch (...) {
-		states.erase(object);
+		if (states.find(object) == nullptr)
+			index.unsubscribe(object, this);
+
 		return -1;
 	}
 
+	vector[object_id] = object;
+
+	// modified while tracked only by other peers
+	if (index.modified(index_id) > journal_epoch)
+		journal_object(object);
+
 	return 0;
 }
 
-Key PeerObject::insert_new(PyObject *object, unsigned int flags) noexcept
+Key PeerObject::insert_new(PyObject *object, uint64_t sent_epoch) noexcept
 {
 	Key key = next_object_id;
 
-	if (insert(object, key, flags) < 0)
+	if (insert(object, key, sent_epoch) < 0)
 		return -1;
 
 	next_object_id++;
@@ -101,40 +196,89 @@ Key PeerObject::insert_new(PyObject *object, unsigned int flags) noexcept
 
 void PeerObject::clear(PyObject *object) noexcept
 {
-	auto i = states.find(object);
-	if (i != states.end())
-		i->second.clear_flag(State::DIRTY_FLAG);
+	State *state = states.find(object);
+	if (state)
+		state->sent_epoch = instance_index().epoch();
+}
+
+void PeerObject::begin_traversal() noexcept
+{
+	if (++traversal == 0) {
+		states.for_each([](void *ptr, State &state) {
+			state.traversal = 0;
+		});
+
+		traversal = 1;
+	}
 }
 
-std::pair<Key, bool> PeerObject::insert_or_clear_for_remote(PyObject *object) noexcept
+// Returns 1 and the remote key on the first visit during the current traversal,
+// 0 on later visits and for immediate values, or -1 on error.  changed tells if
+// the object needs to be (re)sent; the object is considered sent afterwards.
+// The mark of a changed object is stored on the first visit, and returned on
+// later visits; other objects are marked with 0.
+int PeerObject::visit_for_remote(PyObject *object, Key *remote_key, bool *changed, uint32_t *mark) noexcept
 {
-	bool object_changed;
+	auto &index = instance_index();
 	Key key;
 
-	auto i = states.find(object);
-	if (i != states.end()) {
-		object_changed = i->second.test_flag(State::DIRTY_FLAG);
-		i->second.clear_flag(State::DIRTY_FLAG);
-		key = i->second.key;
+	// referenced inline
+	if (wire_version && immediate_key(object) >= 0) {
+		*mark = 0;
+		return 0;
+	}
+
+	State *state = states.find(object);
+	if (state) {
+		if (state->traversal == traversal) {
+			*mark = state->mark;
+			return 0;
+		}
+
+		state->traversal = traversal;
+
+		*changed = state->changed(index);
+		state->sent_epoch = index.epoch();
+		key = state->key;
 	} else {
-		object_changed = true;
-		key = insert_new(object, 0);
+		key = insert_new(object, index.epoch());
+		if (key < 0)
+			return -1;
+
+		state = states.find(object);
+		state->traversal = traversal;
+
+		*changed = true;
 	}
 
-	Key remote_key = key_for_remote(key);
+	state->mark = *changed ? *mark : 0;
+
+	*remote_key = key_for_remote(key);
+	return 1;
+}
 
-	return std::make_pair(remote_key, object_changed);
+void PeerObject::set_traversal_mark(PyObject *object, uint32_t mark) noexcept
+{
+	State *state = states.find(object);
+	if (state)
+		state->mark = mark;
 }
 
 Key PeerObject::key_for_remote(PyObject *object) noexcept
 {
 	Key key;
 
-	auto i = states.find(object);
-	if (i != states.end())
-		key = i->second.key;
+	if (wire_version) {
+		key = immediate_key(object);
+		if (key >= 0)
+			return key;
+	}
+
+	State *state = states.find(object);
+	if (state)
+		key = state->key;
 	else
-		key = insert_new(object, State::DIRTY_FLAG);
+		key = insert_new(object, 0);
 
 	return key_for_remote(key);
 }
@@ -152,13 +296,77 @@ Key PeerObject::key_for_remote(Key key) noexcept
 	return (Key(remote_id) << 32) | object_id;
 }
 
+PyObject **PeerObject::object_slot(Key key) noexcept
+{
+	uint32_t object_id = key;
+	uint32_t remote_id = key >> 32;
+
+	if (remote_id > 1)
+		return nullptr;
+
+	auto &vector = objects[remote_id];
+
+	if (object_id >= vector.size() || vector[object_id] == nullptr)
+		return nullptr;
+
+	return &vector[object_id];
+}
+
+// Returns a borrowed reference to an object created for an immediate key.
+// The peer holds the reference until release_immediates is called.
+PyObject *PeerObject::immediate_object(Key key) noexcept
+{
+	uint64_t payload = key & ~IMMEDIATE_KEY_FLAG;
+	uint64_t value = payload >> 2;
+
+	switch (ImmediateKind(payload & 3)) {
+	case IMMEDIATE_CONSTANT:
+		switch (ImmediateConstant(value)) {
+		case IMMEDIATE_NONE:  return Py_None;
+		case IMMEDIATE_FALSE: return Py_False;
+		case IMMEDIATE_TRUE:  return Py_True;
+		}
+		break;
+
+	case IMMEDIATE_INT:
+		{
+			PyObject *object = PyLong_FromLongLong(wire_unzigzag(value));
+			if (object == nullptr)
+				return nullptr;
+
+			try {
+				immediates.push_back(object);
+			} catch (...) {
+				Py_DECREF(object);
+				return nullptr;
+			}
+
+			return object;
+		}
+	}
+
+	fprintf(stderr, "tap peer: invalid immediate key %ld\n", key);
+	return nullptr;
+}
+
+void PeerObject::release_immediates() noexcept
+{
+	for (PyObject *object: immediates)
+		Py_DECREF(object);
+
+	immediates.clear();
+}
+
 PyObject *PeerObject::object(Key key) noexcept
 {
 	PyObject *object = nullptr;
 
-	auto i = objects.find(key);
-	if (i != objects.end()) {
-		object = i->second;
+	if (key_is_immediate(key))
+		return immediate_object(key);
+
+	PyObject **slot = object_slot(key);
+	if (slot) {
+		object = *slot;
 
 		if (object->ob_refcnt <= 0) {
 			fprintf(stderr, "tap peer: %s object %p with invalid reference count %ld during lookup\n", object->ob_type->tp_name, object, object->ob_refcnt);
@@ -169,55 +377,93 @@ PyObject *PeerObject::object(Key key) noexcept
 	return object;
 }
 
-void PeerObject::touch(PyObject *object) noexcept
-{
-	auto i = states.find(object);
-	if (i != states.end())
-		i->second.set_flag(State::DIRTY_FLAG);
-}
-
-void PeerObject::set_references(const std::unordered_set<PyObject *> &referenced) noexcept
+void PeerObject::set_references(const std::vector<PyObject *> &referenced) noexcept
 {
 	for (PyObject *object: referenced)
-		states.find(object)->second.set_flag(State::REFERENCE_FLAG);
+		states.find(object)->set_flag(State::REFERENCE_FLAG);
 }
 
 void PeerObject::dereference(Key key) noexcept
 {
-	auto i = objects.find(key);
-	if (i != objects.end()) {
-		PyObject *object = i->second;
-		State &state = states.find(object)->second;
+	PyObject **slot = object_slot(key);
+	if (slot) {
+		PyObject *object = *slot;
+		State &state = *states.find(object);
 
 		if (state.test_flag(State::REFERENCE_FLAG)) {
 			state.clear_flag(State::REFERENCE_FLAG);
-			state.set_flag(State::DIRTY_FLAG);
+			state.sent_epoch = 0;
+			journal_object(object);
 
 			Py_DECREF(object);
 		}
 	}
 }
 
-void PeerObject::object_freed(void *ptr) noexcept
+void PeerObject::mark_unsent(PyObject *object) noexcept
 {
-	auto i = states.find(ptr);
-	if (i != states.end()) {
-		PyObject *object = reinterpret_cast<PyObject *> (ptr);
+	State *state = states.find(object);
+	if (state)
+		state->sent_epoch = 0;
+}
 
+void PeerObject::object_freed(PyObject *object) noexcept
+{
+	State *state = states.find(object);
+	if (state) {
 		fprintf(stderr, "tap peer: %s object %p freed\n", object->ob_type->tp_name, object);
 
 		if (object->ob_refcnt != 0)
 			fprintf(stderr, "tap peer: %s object %p with unexpected reference count %ld when freed\n", object->ob_type->tp_name, object, object->ob_refcnt);
 
-		Key key = i->second.key;
+		Key key = state->key;
+
+		PyObject **slot = object_slot(key);
+		if (slot && *slot == object)
+			*slot = nullptr;
 
-		objects.erase(key);
-		states.erase(i);
+		states.erase(object);
 
 		freed.push_back(key);
 	}
 }
 
+void PeerObject::journal_object(PyObject *object) noexcept
+{
+	if (journal_epoch == 0)
+		return;
+
+	try {
+		journal.push_back(object);
+	} catch (...) {
+		// the next incremental marshal will traverse everything
+		journal.clear();
+		journal_epoch = 0;
+	}
+}
+
+// Pushes the journaled objects which are still tracked by this peer.  Freed
+// objects were removed from the states, so stale entries are skipped.
+int PeerObject::push_journal(std::vector<PyObject *> &stack) noexcept
+{
+	try {
+		for (PyObject *object: journal) {
+			if (states.find(object))
+				stack.push_back(object);
+		}
+	} catch (...) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void PeerObject::reset_journal() noexcept
+{
+	journal.clear();
+	journal_epoch = instance_index().begin_journal();
+}
+
 static PyObject *peer_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) noexcept
 {
 	PyObject *peer = type->tp_alloc(type, 0);
@@ -239,6 +485,36 @@ static void peer_dealloc(PyObject *peer) noexcept
 	Py_TYPE(peer)->tp_free(peer);
 }
 
+static PyObject *peer_get_view_threshold(PyObject *peer, void *closure) noexcept
+{
+	return PyLong_FromSsize_t(reinterpret_cast<PeerObject *> (peer)->view_threshold);
+}
+
+static int peer_set_view_threshold(PyObject *peer, PyObject *value, void *closure) noexcept
+{
+	if (value == nullptr) {
+		PyErr_SetString(PyExc_AttributeError, "cannot delete view_threshold");
+		return -1;
+	}
+
+	Py_ssize_t threshold = PyLong_AsSsize_t(value);
+	if (threshold == -1 && PyErr_Occurred())
+		return -1;
+
+	if (threshold < 0) {
+		PyErr_SetString(PyExc_ValueError, "view_threshold must not be negative");
+		return -1;
+	}
+
+	reinterpret_cast<PeerObject *> (peer)->view_threshold = threshold;
+	return 0;
+}
+
+static PyGetSetDef peer_getset[] = {
+	{ const_cast<char *> ("view_threshold"), peer_get_view_threshold, peer_set_view_threshold },
+	{}
+};
+
 int peer_type_init() noexcept
 {
 	return PyType_Ready(&peer_type);
@@ -274,7 +550,7 @@ PyTypeObject peer_type = {
 	0,                              /* tp_iternext */
 	0,                              /* tp_methods */
 	0,                              /* tp_members */
-	0,                              /* tp_getset */
+	peer_getset,                    /* tp_getset */
 	0,                              /* tp_base */
 	0,                              /* tp_dict */
 	0,                              /* tp_descr_get */
@@ -287,8 +563,7 @@ PyTypeObject peer_type = {
 
 void peers_touch(PyObject *object) noexcept
 {
-	for (PeerObject *peer: instance_peers())
-		peer->touch(object);
+	instance_index().touch(object);
 }
 
 } // namespace tap
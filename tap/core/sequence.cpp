@@ -0,0 +1,168 @@
+#include "core.hpp"
+
+namespace tap {
+
+// Shorter sequences aren't worth scanning.
+const Py_ssize_t SEQUENCE_PACKED_MIN_LENGTH = 8;
+
+static bool sequence_int64_check(PyObject *item) noexcept
+{
+	if (Py_TYPE(item) != &PyLong_Type)
+		return false;
+
+	int overflow;
+	PyLong_AsLongLongAndOverflow(item, &overflow);
+	return overflow == 0;
+}
+
+// Chooses a packed layout if all items are ints which fit in 64 bits, or
+// floats.
+SequenceLayout sequence_layout(PyObject *const *items, Py_ssize_t length, unsigned int version) noexcept
+{
+	if (version == 0 || length < SEQUENCE_PACKED_MIN_LENGTH)
+		return SEQUENCE_REFERENCES;
+
+	if (Py_TYPE(items[0]) == &PyFloat_Type) {
+		for (Py_ssize_t i = 1; i < length; ++i)
+			if (Py_TYPE(items[i]) != &PyFloat_Type)
+				return SEQUENCE_REFERENCES;
+
+		return SEQUENCE_FLOAT64;
+	}
+
+	for (Py_ssize_t i = 0; i < length; ++i)
+		if (!sequence_int64_check(items[i]))
+			return SEQUENCE_REFERENCES;
+
+	return SEQUENCE_INT64;
+}
+
+Py_ssize_t sequence_marshaled_size(PyObject *const *items, Py_ssize_t length, unsigned int version) noexcept
+{
+	if (version == 0)
+		return wire_key_size(version) * length;
+
+	Py_ssize_t item_size;
+
+	if (sequence_layout(items, length, version) == SEQUENCE_REFERENCES)
+		item_size = wire_key_size(version);
+	else
+		item_size = sizeof (int64_t);
+
+	return sizeof (uint8_t) + wire_length_size(version) + item_size * length;
+}
+
+int sequence_marshal(PyObject *const *items, Py_ssize_t length, Writer &writer, PeerObject &peer) noexcept
+{
+	unsigned int version = writer.wire_version();
+	SequenceLayout layout = sequence_layout(items, length, version);
+
+	if (version)
+		writer.uint8(layout);
+
+	writer.length(length);
+
+	switch (layout) {
+	case SEQUENCE_REFERENCES:
+		for (Py_ssize_t i = 0; i < length; ++i) {
+			Key remote_key = peer.key_for_remote(items[i]);
+			if (remote_key < 0)
+				return -1;
+
+			writer.key(remote_key);
+		}
+		break;
+
+	case SEQUENCE_INT64:
+		for (Py_ssize_t i = 0; i < length; ++i)
+			writer.fixed_int64(PyLong_AsLongLong(items[i]));
+		break;
+
+	case SEQUENCE_FLOAT64:
+		for (Py_ssize_t i = 0; i < length; ++i)
+			writer.float64(PyFloat_AS_DOUBLE(items[i]));
+		break;
+	}
+
+	return 0;
+}
+
+bool sequence_read_header(Reader &reader, SequenceLayout *layout, Py_ssize_t *length) noexcept
+{
+	if (reader.wire_version() == 0) {
+		*layout = SEQUENCE_REFERENCES;
+		return reader.length(sizeof (Key), length);
+	}
+
+	uint8_t value;
+
+	if (!reader.uint8(&value) || value > SEQUENCE_FLOAT64 || !reader.length(sizeof (Key), length))
+		return false;
+
+	*layout = SequenceLayout(value);
+
+	if (*layout != SEQUENCE_REFERENCES && *length > reader.remaining() / Py_ssize_t(sizeof (int64_t)))
+		return false;
+
+	return true;
+}
+
+// Stores new references to length items.  On error no references are left.
+int sequence_unmarshal_items(Reader &reader, SequenceLayout layout, PyObject **items, Py_ssize_t length, PeerObject &peer) noexcept
+{
+	Py_ssize_t i;
+
+	switch (layout) {
+	case SEQUENCE_REFERENCES:
+		for (i = 0; i < length; ++i) {
+			Key key;
+
+			if (!reader.key(&key))
+				goto fail;
+
+			PyObject *item = peer.object(key);
+			if (item == nullptr)
+				goto fail;
+
+			Py_INCREF(item);
+			items[i] = item;
+		}
+		break;
+
+	case SEQUENCE_INT64:
+		for (i = 0; i < length; ++i) {
+			int64_t value;
+
+			if (!reader.fixed_int64(&value))
+				goto fail;
+
+			items[i] = PyLong_FromLongLong(value);
+			if (items[i] == nullptr)
+				goto fail;
+		}
+		break;
+
+	case SEQUENCE_FLOAT64:
+		for (i = 0; i < length; ++i) {
+			double value;
+
+			if (!reader.float64(&value))
+				goto fail;
+
+			items[i] = PyFloat_FromDouble(value);
+			if (items[i] == nullptr)
+				goto fail;
+		}
+		break;
+	}
+
+	return 0;
+
+fail:
+	while (i > 0)
+		Py_DECREF(items[--i]);
+
+	return -1;
+}
+
+} // namespace tap
@@ -0,0 +1,284 @@
+#include "core.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace tap {
+
+// Sets aren't subscriptable, so the mutating methods and in-place operators
+// are wrapped instead.
+template <int I>
+struct SetMethodWrap {
+	static PyObject *call(PyObject *self, PyObject *args) noexcept
+	{
+		PyObject *result = orig(self, args);
+		if (result)
+			peers_touch(self);
+
+		return result;
+	}
+
+	static PyCFunction orig;
+};
+
+template <int I> PyCFunction SetMethodWrap<I>::orig;
+
+template <int I>
+struct SetInplaceWrap {
+	static PyObject *call(PyObject *self, PyObject *other) noexcept
+	{
+		PyObject *result = orig(self, other);
+		if (result == self)
+			peers_touch(self);
+
+		return result;
+	}
+
+	static void init(binaryfunc *slot) noexcept
+	{
+		orig = *slot;
+		*slot = call;
+	}
+
+	static binaryfunc orig;
+};
+
+template <int I> binaryfunc SetInplaceWrap<I>::orig;
+
+template <int I>
+static void set_method_wrap(const char *name) noexcept
+{
+	for (PyMethodDef *def = PySet_Type.tp_methods; def->ml_name; ++def) {
+		if (strcmp(def->ml_name, name) == 0) {
+			SetMethodWrap<I>::orig = def->ml_meth;
+			def->ml_meth = SetMethodWrap<I>::call;
+			break;
+		}
+	}
+}
+
+void set_py_type_init() noexcept
+{
+	set_method_wrap<0>("add");
+	set_method_wrap<1>("clear");
+	set_method_wrap<2>("difference_update");
+	set_method_wrap<3>("discard");
+	set_method_wrap<4>("intersection_update");
+	set_method_wrap<5>("pop");
+	set_method_wrap<6>("remove");
+	set_method_wrap<7>("symmetric_difference_update");
+	set_method_wrap<8>("update");
+
+	PyNumberMethods *number = PySet_Type.tp_as_number;
+
+	SetInplaceWrap<0>::init(&number->nb_inplace_and);
+	SetInplaceWrap<1>::init(&number->nb_inplace_or);
+	SetInplaceWrap<2>::init(&number->nb_inplace_subtract);
+	SetInplaceWrap<3>::init(&number->nb_inplace_xor);
+}
+
+static int set_traverse(PyObject *object, visitproc visit, void *arg) noexcept
+{
+	Py_ssize_t pos = 0;
+	PyObject *key;
+	Py_hash_t hash;
+
+	while (_PySet_NextEntry(object, &pos, &key, &hash))
+		Py_VISIT(key);
+
+	return 0;
+}
+
+static Py_ssize_t set_marshaled_size(PyObject *object, unsigned int version) noexcept
+{
+	return wire_length_size(version) + wire_key_size(version) * PySet_GET_SIZE(object);
+}
+
+static int set_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	Py_ssize_t pos = 0;
+	PyObject *key;
+	Py_hash_t hash;
+
+	writer.length(PySet_GET_SIZE(object));
+
+	while (_PySet_NextEntry(object, &pos, &key, &hash)) {
+		Key remote_key = peer.key_for_remote(key);
+		if (remote_key < 0)
+			return -1;
+
+		writer.key(remote_key);
+	}
+
+	return 0;
+}
+
+// Replaces the small table of an empty set with one which holds length items
+// without resizing, like set_table_resize would.  This depends on the
+// setobject layout of CPython 3.4 to 3.6; elsewhere sets grow as items are
+// added.
+static int set_presize(PyObject *object, Py_ssize_t length) noexcept
+{
+#if PY_VERSION_HEX >= 0x03040000 && PY_VERSION_HEX < 0x03070000
+	PySetObject *set = reinterpret_cast<PySetObject *> (object);
+	size_t size = PySet_MINSIZE;
+
+	while (size_t(length) * 3 >= (size - 1) * 2)
+		size <<= 1;
+
+	if (size == PySet_MINSIZE || set->table != set->smalltable || set->fill)
+		return 0;
+
+	setentry *table = PyMem_NEW(setentry, size);
+	if (table == nullptr) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	memset(table, 0, sizeof (setentry) * size);
+	set->table = table;
+	set->mask = size - 1;
+#endif
+
+	return 0;
+}
+
+// Stores new references to length items.  On error no references are left.
+static int set_unmarshal_items(Reader &reader, PyObject **items, Py_ssize_t length, PeerObject &peer) noexcept
+{
+	for (Py_ssize_t i = 0; i < length; ++i) {
+		Key key;
+
+		if (!reader.key(&key) || (items[i] = peer.object(key)) == nullptr) {
+			while (i > 0)
+				Py_DECREF(items[--i]);
+
+			return -1;
+		}
+
+		Py_INCREF(items[i]);
+	}
+
+	return 0;
+}
+
+static int set_add_items(PyObject *object, PyObject *const *items, Py_ssize_t length) noexcept
+{
+	int ret = set_presize(object, length);
+
+	for (Py_ssize_t i = 0; i < length; ++i) {
+		if (ret == 0)
+			ret = PySet_Add(object, items[i]);
+
+		Py_DECREF(items[i]);
+	}
+
+	return ret;
+}
+
+static PyObject *set_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key), &length))
+		return nullptr;
+
+	return PySet_New(nullptr);
+}
+
+static PyObject *frozenset_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key), &length))
+		return nullptr;
+
+	return PyFrozenSet_New(nullptr);
+}
+
+// New sets aren't visible to other code yet, so the items are added as they
+// are read.
+static int set_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key), &length) || set_presize(object, length) < 0)
+		return -1;
+
+	for (Py_ssize_t i = 0; i < length; ++i) {
+		Key key;
+		PyObject *item;
+
+		if (!reader.key(&key) || (item = peer.object(key)) == nullptr || PySet_Add(object, item) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+// PySet_Add fills in a new frozenset only while it has a single reference.
+// Other objects created by the same message may already refer to it (they
+// are initialized first in older wire versions, and in cycles), but they
+// aren't visible to other code yet either.
+static int frozenset_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t shared = object->ob_refcnt - 1;
+
+	object->ob_refcnt -= shared;
+	int ret = set_unmarshal_init(object, reader, peer);
+	object->ob_refcnt += shared;
+
+	return ret;
+}
+
+// The new items are referenced before the old ones are released, since they
+// may be the same objects.
+static int set_unmarshal_update(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t length;
+
+	if (!reader.length(sizeof (Key), &length))
+		return -1;
+
+	std::vector<PyObject *> items;
+
+	try {
+		items.resize(length);
+	} catch (...) {
+		return -1;
+	}
+
+	if (set_unmarshal_items(reader, items.data(), length, peer) < 0)
+		return -1;
+
+	if (PySet_Clear(object) < 0) {
+		for (PyObject *item: items)
+			Py_DECREF(item);
+
+		return -1;
+	}
+
+	return set_add_items(object, items.data(), length);
+}
+
+const TypeHandler set_type_handler = {
+	SET_TYPE_ID,
+	set_traverse,
+	set_marshaled_size,
+	set_marshal,
+	set_unmarshal_alloc,
+	set_unmarshal_init,
+	set_unmarshal_update,
+};
+
+const TypeHandler frozenset_type_handler = {
+	FROZENSET_TYPE_ID,
+	set_traverse,
+	set_marshaled_size,
+	set_marshal,
+	frozenset_unmarshal_alloc,
+	frozenset_unmarshal_init,
+};
+
+} // namespace tap
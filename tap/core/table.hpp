@@ -0,0 +1,155 @@
+#ifndef TAP_CORE_TABLE_HPP
+#define TAP_CORE_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tap {
+
+/*
+ * Open-addressing hash table keyed by object address.  Linear probing with
+ * backward-shift deletion keeps the slots contiguous and tombstone-free, so
+ * both hits and misses touch only a cache line or two.  Insertion may throw
+ * std::bad_alloc; everything else is noexcept.  Pointers returned by find()
+ * and insert() are invalidated by the next insert() or erase().
+ */
+template <typename T>
+class PointerTable {
+public:
+	PointerTable() noexcept:
+		mask(0),
+		shift(0),
+		count(0)
+	{
+	}
+
+	size_t size() const noexcept
+	{
+		return count;
+	}
+
+	T *find(const void *ptr) noexcept
+	{
+		if (count == 0 || ptr == nullptr)
+			return nullptr;
+
+		for (size_t i = hash(ptr);; i = (i + 1) & mask) {
+			Slot &slot = slots[i];
+
+			if (slot.ptr == ptr)
+				return &slot.value;
+
+			if (slot.ptr == nullptr)
+				return nullptr;
+		}
+	}
+
+	const T *find(const void *ptr) const noexcept
+	{
+		return const_cast<PointerTable *> (this)->find(ptr);
+	}
+
+	// Returns the existing value or a default-constructed one.
+	T *insert(const void *ptr)
+	{
+		if ((count + 1) * 2 > slots.size())
+			grow();
+
+		for (size_t i = hash(ptr);; i = (i + 1) & mask) {
+			Slot &slot = slots[i];
+
+			if (slot.ptr == ptr)
+				return &slot.value;
+
+			if (slot.ptr == nullptr) {
+				slot.ptr = ptr;
+				slot.value = T();
+				count++;
+				return &slot.value;
+			}
+		}
+	}
+
+	bool erase(const void *ptr) noexcept
+	{
+		if (count == 0 || ptr == nullptr)
+			return false;
+
+		size_t i = hash(ptr);
+
+		while (slots[i].ptr != ptr) {
+			if (slots[i].ptr == nullptr)
+				return false;
+
+			i = (i + 1) & mask;
+		}
+
+		// shift the following run back so that lookups never see a hole
+		for (size_t j = (i + 1) & mask; slots[j].ptr; j = (j + 1) & mask) {
+			size_t home = hash(slots[j].ptr);
+
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+
+		slots[i].ptr = nullptr;
+		count--;
+
+		return true;
+	}
+
+	template <typename Func>
+	void for_each(Func func) noexcept
+	{
+		for (Slot &slot: slots) {
+			if (slot.ptr)
+				func(const_cast<void *> (slot.ptr), slot.value);
+		}
+	}
+
+private:
+	struct Slot {
+		const void *ptr;
+		T value;
+	};
+
+	size_t hash(const void *ptr) const noexcept
+	{
+		uint64_t x = reinterpret_cast<uintptr_t> (ptr) >> 4;
+		return (x * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - shift) & mask;
+	}
+
+	void grow()
+	{
+		size_t capacity = slots.empty() ? 16 : slots.size() * 2;
+		std::vector<Slot> old(capacity, Slot());
+
+		slots.swap(old);
+		mask = capacity - 1;
+		for (shift = 0; (size_t(1) << shift) < capacity; shift++) {
+		}
+
+		for (Slot &slot: old) {
+			if (slot.ptr) {
+				size_t i = hash(slot.ptr);
+
+				while (slots[i].ptr)
+					i = (i + 1) & mask;
+
+				slots[i] = slot;
+			}
+		}
+	}
+
+	std::vector<Slot> slots;
+	size_t mask;
+	unsigned int shift;
+	size_t count;
+};
+
+} // namespace tap
+
+#endif
@@ -1,5 +1,4 @@
 #include "core.hpp"
-#include "portable.hpp"
 
 namespace tap {
 
@@ -11,48 +10,46 @@ static int tuple_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 	return 0;
 }
 
-static Py_ssize_t tuple_marshaled_size(PyObject *object) noexcept
+static PyObject *const *tuple_items(PyObject *object) noexcept
 {
-	return sizeof (Key) * PyTuple_GET_SIZE(object);
+	return reinterpret_cast<PyTupleObject *> (object)->ob_item;
 }
 
-static int tuple_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static Py_ssize_t tuple_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
-	Key *portable = reinterpret_cast<Key *> (buf);
-
-	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(object); ++i) {
-		Key remote_key = peer.key_for_remote(PyTuple_GET_ITEM(object, i));
-		if (remote_key < 0)
-			return -1;
-
-		portable[i] = port(remote_key);
-	}
+	return sequence_marshaled_size(tuple_items(object), PyTuple_GET_SIZE(object), version);
+}
 
-	return 0;
+static int tuple_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
+{
+	return sequence_marshal(tuple_items(object), PyTuple_GET_SIZE(object), writer, peer);
 }
 
-static PyObject *tuple_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *tuple_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size % sizeof (Key))
+	SequenceLayout layout;
+	Py_ssize_t length;
+
+	if (!sequence_read_header(reader, &layout, &length))
 		return nullptr;
 
-	return PyTuple_New(size / sizeof (Key));
+	return PyTuple_New(length);
 }
 
-static int tuple_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int tuple_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
-	const Key *portable = reinterpret_cast<const Key *> (data);
+	SequenceLayout layout;
+	Py_ssize_t length;
 
-	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(object); ++i) {
-		PyObject *item = peer.object(port(portable[i]));
-		if (item == nullptr)
-			return -1;
+	if (!sequence_read_header(reader, &layout, &length) || length != PyTuple_GET_SIZE(object))
+		return -1;
 
-		Py_INCREF(item);
-		PyTuple_SET_ITEM(object, i, item);
-	}
+	return sequence_unmarshal_items(reader, layout, reinterpret_cast<PyTupleObject *> (object)->ob_item, length, peer);
+}
 
-	return 0;
+static bool tuple_by_value(PyObject *object, unsigned int version) noexcept
+{
+	return sequence_layout(tuple_items(object), PyTuple_GET_SIZE(object), version) != SEQUENCE_REFERENCES;
 }
 
 const TypeHandler tuple_type_handler = {
@@ -62,6 +59,9 @@ const TypeHandler tuple_type_handler = {
 	tuple_marshal,
 	tuple_unmarshal_alloc,
 	tuple_unmarshal_init,
+	nullptr,
+	nullptr,
+	tuple_by_value,
 };
 
 } // namespace tap
@@ -3,105 +3,210 @@
 
 namespace tap {
 
-const TypeHandler *type_handler_for_object(PyObject *object) noexcept
+int type_init() noexcept
 {
-	PyTypeObject *type = object->ob_type;
-
-	if (object == Py_None) return &none_type_handler;
-	if (type == &PyType_Type) return &type_type_handler;
-	if (type == &PyBool_Type) return &bool_type_handler;
-	if (type == &PyLong_Type) return &long_type_handler;
-	if (type == &PyTuple_Type) return &tuple_type_handler;
-	if (type == &PyList_Type) return &list_type_handler;
-	if (type == &PyDict_Type) return &dict_type_handler;
-	if (type == &PyBytes_Type) return &bytes_type_handler;
-	if (type == &PyUnicode_Type) return &unicode_type_handler;
-	if (type == &PyCode_Type) return &code_type_handler;
-	if (type == &PyFunction_Type) return &function_type_handler;
-	if (type == &PyModule_Type) return &module_type_handler;
-	if (type == &PyCFunction_Type && builtin_check(object)) return &builtin_type_handler;
-	if (type == &PyFrame_Type) return &frame_type_handler;
-	if (type == &PyGen_Type) return &gen_type_handler;
+	const TypeRegistration builtins[] = {
+		{ Py_TYPE(Py_None), &none_type_handler },
+		{ &PyType_Type, &type_type_handler },
+		{ &PyBool_Type, &bool_type_handler },
+		{ &PyLong_Type, &long_type_handler },
+		{ &PyTuple_Type, &tuple_type_handler },
+		{ &PyList_Type, &list_type_handler },
+		{ &PyDict_Type, &dict_type_handler },
+		{ &PyBytes_Type, &bytes_type_handler },
+		{ &PyUnicode_Type, &unicode_type_handler },
+		{ &PyCode_Type, &code_type_handler },
+		{ &PyFunction_Type, &function_type_handler },
+		{ &PyModule_Type, &module_type_handler },
+		{ &PyCFunction_Type, &builtin_type_handler },
+		{ &PyFrame_Type, &frame_type_handler },
+		{ &PyGen_Type, &gen_type_handler },
+		{ &PyFloat_Type, &float_type_handler },
+		{ &PySet_Type, &set_type_handler },
+		{ &PyFrozenSet_Type, &frozenset_type_handler },
+	};
+
+	for (const TypeRegistration &builtin: builtins)
+		if (type_register(builtin.type, builtin.handler) < 0)
+			return -1;
 
-	return &opaque_type_handler;
+	return 0;
 }
 
-const TypeHandler *type_handler_for_id(int32_t type_id) noexcept
+// Maps objects of the exact type to the handler, and the handler's type id
+// to the type unless the id is already taken.  Several types may share a
+// handler, but a type can be registered only once.  Registered types are kept
+// alive, since they can't be unregistered.
+int type_register(PyTypeObject *type, const TypeHandler *handler) noexcept
 {
-	if (type_id >= 0 && type_id < TYPE_ID_COUNT) {
-		switch (TypeId(type_id)) {
-		case OPAQUE_TYPE_ID: return &opaque_type_handler;
-		case NONE_TYPE_ID: return &none_type_handler;
-		case TYPE_TYPE_ID: return &type_type_handler;
-		case BOOL_TYPE_ID: return &bool_type_handler;
-		case LONG_TYPE_ID: return &long_type_handler;
-		case TUPLE_TYPE_ID: return &tuple_type_handler;
-		case LIST_TYPE_ID: return &list_type_handler;
-		case DICT_TYPE_ID: return &dict_type_handler;
-		case BYTES_TYPE_ID: return &bytes_type_handler;
-		case UNICODE_TYPE_ID: return &unicode_type_handler;
-		case CODE_TYPE_ID: return &code_type_handler;
-		case FUNCTION_TYPE_ID: return &function_type_handler;
-		case MODULE_TYPE_ID: return &module_type_handler;
-		case BUILTIN_TYPE_ID: return &builtin_type_handler;
-		case FRAME_TYPE_ID: return &frame_type_handler;
-		case GEN_TYPE_ID: return &gen_type_handler;
-
-		case TYPE_ID_COUNT: break;
-		}
+	if (handler->type_id <= OPAQUE_TYPE_ID || handler->type_id >= TYPE_ID_LIMIT)
+		return -1;
+
+	auto &handlers = instance_type_handlers();
+	auto &registrations = instance_type_registrations();
+
+	if (handlers.find(type))
+		return -1;
+
+	if (size_t(handler->type_id) < registrations.size()) {
+		const TypeHandler *other = registrations[handler->type_id].handler;
+		if (other && other != handler)
+			return -1;
 	}
 
-	return nullptr;
+	try {
+		if (size_t(handler->type_id) >= registrations.size())
+			registrations.resize(handler->type_id + 1, TypeRegistration());
+
+		*handlers.insert(type) = handler;
+	} catch (...) {
+		return -1;
+	}
+
+	Py_INCREF(type);
+
+	TypeRegistration &registration = registrations[handler->type_id];
+
+	if (registration.handler == nullptr) {
+		registration.type = type;
+		registration.handler = handler;
+	}
+
+	return 0;
 }
 
-struct Portable {
-	int32_t type_id;
-	char opaque_name[];
-} TAP_PACKED;
+const TypeHandler *type_handler_for_object(PyObject *object) noexcept
+{
+	const TypeHandler *const *handler = instance_type_handlers().find(Py_TYPE(object));
+
+	if (handler == nullptr) {
+		if (object_check(Py_TYPE(object)))
+			return &object_type_handler;
+
+		return &opaque_type_handler;
+	}
+
+	// builtins are resolved by module name
+	if (*handler == &builtin_type_handler && !builtin_check(object))
+		return &opaque_type_handler;
+
+	return *handler;
+}
+
+static const TypeRegistration *type_registration_for_id(int32_t type_id) noexcept
+{
+	auto &registrations = instance_type_registrations();
+
+	if (type_id <= OPAQUE_TYPE_ID || size_t(type_id) >= registrations.size())
+		return nullptr;
+
+	return &registrations[type_id];
+}
+
+const TypeHandler *type_handler_for_id(int32_t type_id) noexcept
+{
+	if (type_id == OPAQUE_TYPE_ID)
+		return &opaque_type_handler;
+
+	if (type_id == OBJECT_TYPE_ID)
+		return &object_type_handler;
+
+	const TypeRegistration *registration = type_registration_for_id(type_id);
+	if (registration == nullptr)
+		return nullptr;
+
+	return registration->handler;
+}
 
 static int type_traverse(PyObject *object, visitproc visit, void *arg) noexcept
 {
 	return 0;
 }
 
-static Py_ssize_t type_marshaled_size(PyObject *object) noexcept
+// Type objects are sent as the type id of their instances' handler.
+// Classes are followed by their importable name, and other unregistered
+// types by their name.
+static const TypeHandler *type_handler_for_type(PyObject *object) noexcept
 {
-	auto handler = type_handler_for_object(object);
-	Py_ssize_t size = sizeof (Portable);
+	const TypeHandler *const *handler = instance_type_handlers().find(object);
+	if (handler)
+		return *handler;
+
+	if (object_check(reinterpret_cast<PyTypeObject *> (object)))
+		return &object_type_handler;
 
-	if (handler->type_id == OPAQUE_TYPE_ID)
-		size += strlen(Py_TYPE(object)->tp_name);
+	return &opaque_type_handler;
+}
+
+static bool type_named(const TypeHandler *handler) noexcept
+{
+	return handler->type_id == OPAQUE_TYPE_ID || handler->type_id == OBJECT_TYPE_ID;
+}
+
+// Returns a new reference to a bytes object.
+static PyObject *type_name(PyObject *object, const TypeHandler *handler) noexcept
+{
+	auto type = reinterpret_cast<PyTypeObject *> (object);
+
+	if (handler->type_id == OBJECT_TYPE_ID)
+		return object_class_name(type);
+
+	return PyBytes_FromString(type->tp_name);
+}
+
+static Py_ssize_t type_marshaled_size(PyObject *object, unsigned int version) noexcept
+{
+	auto handler = type_handler_for_type(object);
+	Py_ssize_t size = wire_int32_size(version);
+
+	if (type_named(handler)) {
+		PyObject *name = type_name(object, handler);
+		if (name == nullptr)
+			return -1;
+
+		size += PyBytes_GET_SIZE(name);
+		Py_DECREF(name);
+	}
 
 	return size;
 }
 
-static int type_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int type_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
-	auto handler = type_handler_for_object(object);
-	auto portable = reinterpret_cast<Portable *> (buf);
+	auto handler = type_handler_for_type(object);
+
+	writer.int32(handler->type_id);
 
-	portable->type_id = port(handler->type_id);
+	if (type_named(handler)) {
+		PyObject *name = type_name(object, handler);
+		if (name == nullptr)
+			return -1;
 
-	if (handler->type_id == OPAQUE_TYPE_ID) {
-		const char *name = Py_TYPE(object)->tp_name;
-		memcpy(portable->opaque_name, name, strlen(name));
+		writer.data(PyBytes_AS_STRING(name), PyBytes_GET_SIZE(name));
+		Py_DECREF(name);
 	}
 
 	return 0;
 }
 
-static PyObject *type_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static PyObject *type_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
 {
-	if (size < Py_ssize_t(sizeof (Portable)))
+	int32_t type_id;
+
+	if (!reader.int32(&type_id))
 		return nullptr;
 
-	const Portable *portable = reinterpret_cast<const Portable *> (data);
-	auto type_id = port(portable->type_id);
-	auto opaque_name_len = size - sizeof (Portable);
+	auto opaque_name_len = reader.remaining();
+	auto opaque_name = reinterpret_cast<const char *> (reader.data(opaque_name_len));
 
-	if (type_id == OPAQUE_TYPE_ID) {
+	if (type_id == OPAQUE_TYPE_ID || type_id == OBJECT_TYPE_ID) {
 		if (opaque_name_len == 0)
 			return nullptr;
+
+		if (!unicode_verify_utf8(opaque_name, opaque_name_len)) {
+			fprintf(stderr, "tap type unmarshal: bad UTF-8 in type name\n");
+			return nullptr;
+		}
 	} else {
 		if (opaque_name_len > 0)
 			return nullptr;
@@ -109,47 +214,27 @@ static PyObject *type_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObj
 
 	PyTypeObject *type = nullptr;
 
-	if (type_id >= 0 && type_id < TYPE_ID_COUNT) {
-		switch (TypeId(type_id)) {
-		case OPAQUE_TYPE_ID:
-			if (!unicode_verify_utf8(portable->opaque_name, opaque_name_len)) {
-				fprintf(stderr, "tap type unmarshal: bad UTF-8 in opaque name\n");
-				return nullptr;
-			}
-
-			try {
-				const std::string name(portable->opaque_name, opaque_name_len);
-				type = opaque_type_for_name(name);
-			} catch (...) {
-				return nullptr;
-			}
-
-			break;
-
-		case NONE_TYPE_ID: type = Py_TYPE(Py_None); break;
-		case TYPE_TYPE_ID: type = &PyType_Type; break;
-		case BOOL_TYPE_ID: type = &PyBool_Type; break;
-		case LONG_TYPE_ID: type = &PyLong_Type; break;
-		case TUPLE_TYPE_ID: type = &PyTuple_Type; break;
-		case LIST_TYPE_ID: type = &PyList_Type; break;
-		case DICT_TYPE_ID: type = &PyDict_Type; break;
-		case BYTES_TYPE_ID: type = &PyBytes_Type; break;
-		case UNICODE_TYPE_ID: type = &PyUnicode_Type; break;
-		case CODE_TYPE_ID: type = &PyCode_Type; break;
-		case FUNCTION_TYPE_ID: type = &PyFunction_Type; break;
-		case MODULE_TYPE_ID: type = &PyModule_Type; break;
-		case BUILTIN_TYPE_ID: type = &PyCFunction_Type; break;
-		case FRAME_TYPE_ID: type = &PyFrame_Type; break;
-		case GEN_TYPE_ID: type = &PyGen_Type; break;
-
-		case TYPE_ID_COUNT: break;
+	if (type_id == OBJECT_TYPE_ID)
+		return reinterpret_cast<PyObject *> (object_class_for_name(opaque_name, opaque_name_len));
+
+	if (type_id == OPAQUE_TYPE_ID) {
+		try {
+			const std::string name(opaque_name, opaque_name_len);
+			type = opaque_type_for_name(name);
+		} catch (...) {
+			return nullptr;
 		}
+	} else {
+		const TypeRegistration *registration = type_registration_for_id(type_id);
+		if (registration)
+			type = registration->type;
 	}
 
+	Py_XINCREF(type);
 	return reinterpret_cast<PyObject *> (type);
 }
 
-static int type_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static int type_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
 {
 	return 0;
 }
@@ -4,6 +4,10 @@
 #include <cassert>
 #include <cstring>
 
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
 namespace tap {
 
 static int unicode_traverse(PyObject *object, visitproc visit, void *arg) noexcept
@@ -11,7 +15,7 @@ static int unicode_traverse(PyObject *object, visitproc visit, void *arg) noexce
 	return 0;
 }
 
-static Py_ssize_t unicode_marshaled_size(PyObject *object) noexcept
+static Py_ssize_t unicode_marshaled_size(PyObject *object, unsigned int version) noexcept
 {
 	Py_ssize_t size;
 
@@ -21,67 +25,251 @@ static Py_ssize_t unicode_marshaled_size(PyObject *object) noexcept
 	return size;
 }
 
-static int unicode_marshal(PyObject *object, void *buf, Py_ssize_t size, PeerObject &peer) noexcept
+static int unicode_marshal(PyObject *object, Writer &writer, PeerObject &peer) noexcept
 {
-	const char *data = PyUnicode_AsUTF8(object);
+	Py_ssize_t size;
+
+	const char *data = PyUnicode_AsUTF8AndSize(object, &size);
 	if (data == nullptr)
 		return -1;
 
-	memcpy(buf, data, size);
+	writer.payload(data, size);
 	return 0;
 }
 
-static PyObject *unicode_unmarshal_alloc(const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+static Py_ssize_t unicode_payload(PyObject *object) noexcept
 {
-	if (!unicode_verify_utf8(data, size)) {
-		fprintf(stderr, "tap unicode unmarshal: bad UTF-8\n");
-		return nullptr;
+	return unicode_marshaled_size(object, 0);
+}
+
+// Returns the number of leading ASCII bytes.
+static Py_ssize_t ascii_prefix_generic(const uint8_t *bytes, Py_ssize_t size) noexcept
+{
+	Py_ssize_t i = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, bytes + i, 8);
+		if (word & 0x8080808080808080ULL)
+			break;
 	}
 
-	return PyUnicode_FromStringAndSize(reinterpret_cast<const char *> (data), size);
+	while (i < size && bytes[i] < 0x80)
+		i++;
+
+	return i;
 }
 
-static int unicode_unmarshal_init(PyObject *object, const void *data, Py_ssize_t size, PeerObject &peer) noexcept
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64.
+static Py_ssize_t ascii_prefix_sse2(const uint8_t *bytes, Py_ssize_t size) noexcept
 {
-	return 0;
+	Py_ssize_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *> (bytes + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ascii_prefix_generic(bytes + i, size - i);
 }
 
-bool unicode_verify_utf8(const void *data, Py_ssize_t size) noexcept
+__attribute__ ((target ("avx2")))
+static Py_ssize_t ascii_prefix_avx2(const uint8_t *bytes, Py_ssize_t size) noexcept
+{
+	Py_ssize_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *> (bytes + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ascii_prefix_sse2(bytes + i, size - i);
+}
+
+#endif
+
+static Py_ssize_t (*ascii_prefix)(const uint8_t *bytes, Py_ssize_t size) = ascii_prefix_generic;
+
+void unicode_init() noexcept
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		ascii_prefix = ascii_prefix_avx2;
+	else
+		ascii_prefix = ascii_prefix_sse2;
+#endif
+}
+
+// Decodes a multi-byte sequence.  Overlong forms, surrogates and code points
+// beyond U+10FFFF are rejected.  Returns the length of the sequence, or 0.
+static Py_ssize_t utf8_sequence(const uint8_t *bytes, Py_ssize_t size, Py_UCS4 *c) noexcept
+{
+	uint8_t lead = bytes[0];
+	uint8_t min = 0x80;
+	uint8_t max = 0xbf;
+	Py_ssize_t length;
+
+	if (lead >= 0xc2 && lead <= 0xdf) {
+		length = 2;
+		*c = lead & 0x1f;
+	} else if (lead >= 0xe0 && lead <= 0xef) {
+		length = 3;
+		*c = lead & 0x0f;
+
+		if (lead == 0xe0)
+			min = 0xa0;
+		else if (lead == 0xed)
+			max = 0x9f;
+	} else if (lead >= 0xf0 && lead <= 0xf4) {
+		length = 4;
+		*c = lead & 0x07;
+
+		if (lead == 0xf0)
+			min = 0x90;
+		else if (lead == 0xf4)
+			max = 0x8f;
+	} else {
+		return 0;
+	}
+
+	if (length > size || bytes[1] < min || bytes[1] > max)
+		return 0;
+
+	for (Py_ssize_t i = 1; i < length; i++) {
+		if (i > 1 && (bytes[i] & 0xc0) != 0x80)
+			return 0;
+
+		*c = (*c << 6) | (bytes[i] & 0x3f);
+	}
+
+	return length;
+}
+
+// Validates UTF-8 text, and finds the number of code points and the largest
+// one.
+bool unicode_scan_utf8(const void *data, Py_ssize_t size, Py_ssize_t *length, Py_UCS4 *max_char) noexcept
 {
 	const uint8_t *bytes = reinterpret_cast<const uint8_t *> (data);
+	Py_ssize_t extra = 0;
+	Py_UCS4 max = 0;
 	Py_ssize_t i = 0;
 
-	while (i < size) {
-		uint8_t byte = bytes[i++];
+	while (true) {
+		i += ascii_prefix(bytes + i, size - i);
+		if (i == size)
+			break;
 
-		if (byte & 0x80) {
-			Py_ssize_t skip;
+		do {
+			Py_UCS4 c;
+			Py_ssize_t n;
 
-			if ((byte & 0xe0) == 0xc0) {
-				skip = 1;
-			} else if ((byte & 0xf0) == 0xe0) {
-				skip = 2;
-			} else if ((byte & 0xf8) == 0xf0) {
-				skip = 3;
+			// two-byte sequences are checked inline
+			if (bytes[i] >= 0xc2 && bytes[i] <= 0xdf && i + 1 < size && (bytes[i + 1] & 0xc0) == 0x80) {
+				c = ((bytes[i] & 0x1f) << 6) | (bytes[i + 1] & 0x3f);
+				n = 2;
 			} else {
-				return false;
+				n = utf8_sequence(bytes + i, size - i, &c);
+				if (n == 0)
+					return false;
 			}
 
-			Py_ssize_t next = i + skip;
-			if (next > size)
-				return false;
+			if (c > max)
+				max = c;
 
-			for (; i < next; i++) {
-				byte = bytes[i];
-				if ((byte & 0xc0) != 0x80)
-					return false;
-			}
-		}
+			i += n;
+			extra += n - 1;
+		} while (i < size && bytes[i] >= 0x80);
 	}
 
+	*length = size - extra;
+	*max_char = max;
 	return true;
 }
 
+bool unicode_verify_utf8(const void *data, Py_ssize_t size) noexcept
+{
+	Py_ssize_t length;
+	Py_UCS4 max_char;
+
+	return unicode_scan_utf8(data, size, &length, &max_char);
+}
+
+// Decodes text which has been validated.
+template <typename Char>
+static void unicode_decode(const uint8_t *bytes, Py_ssize_t size, Char *chars) noexcept
+{
+	const uint8_t *end = bytes + size;
+
+	while (bytes < end) {
+		Py_UCS4 c = bytes[0];
+
+		if (c < 0x80) {
+			bytes += 1;
+		} else if (c < 0xe0) {
+			c = ((c & 0x1f) << 6) | (bytes[1] & 0x3f);
+			bytes += 2;
+		} else if (c < 0xf0) {
+			c = ((c & 0x0f) << 12) | ((bytes[1] & 0x3f) << 6) | (bytes[2] & 0x3f);
+			bytes += 3;
+		} else {
+			c = ((c & 0x07) << 18) | ((bytes[1] & 0x3f) << 12) | ((bytes[2] & 0x3f) << 6) | (bytes[3] & 0x3f);
+			bytes += 4;
+		}
+
+		*chars++ = Char(c);
+	}
+}
+
+// The string is created with the smallest representation which fits the
+// text, and filled directly.
+static PyObject *unicode_unmarshal_alloc(Reader &reader, PeerObject &peer) noexcept
+{
+	Py_ssize_t size = reader.remaining();
+	auto bytes = reinterpret_cast<const uint8_t *> (reader.data(size));
+	Py_ssize_t length;
+	Py_UCS4 max_char;
+
+	if (!unicode_scan_utf8(bytes, size, &length, &max_char)) {
+		fprintf(stderr, "tap unicode unmarshal: bad UTF-8\n");
+		return nullptr;
+	}
+
+	PyObject *object = PyUnicode_New(length, max_char);
+	if (object == nullptr)
+		return nullptr;
+
+	switch (PyUnicode_KIND(object)) {
+	case PyUnicode_1BYTE_KIND:
+		if (max_char < 0x80)
+			memcpy(PyUnicode_1BYTE_DATA(object), bytes, size);
+		else
+			unicode_decode(bytes, size, PyUnicode_1BYTE_DATA(object));
+		break;
+
+	case PyUnicode_2BYTE_KIND:
+		unicode_decode(bytes, size, PyUnicode_2BYTE_DATA(object));
+		break;
+
+	case PyUnicode_4BYTE_KIND:
+		unicode_decode(bytes, size, PyUnicode_4BYTE_DATA(object));
+		break;
+	}
+
+	return object;
+}
+
+static int unicode_unmarshal_init(PyObject *object, Reader &reader, PeerObject &peer) noexcept
+{
+	return 0;
+}
+
 const TypeHandler unicode_type_handler = {
 	UNICODE_TYPE_ID,
 	unicode_traverse,
@@ -89,6 +277,8 @@ const TypeHandler unicode_type_handler = {
 	unicode_marshal,
 	unicode_unmarshal_alloc,
 	unicode_unmarshal_init,
+	nullptr,
+	unicode_payload,
 };
 
 } // namespace tap
@@ -0,0 +1,95 @@
+#include "core.hpp"
+
+namespace tap {
+
+// Read-only buffer over memory owned by another object, which is kept alive
+// for as long as the view (or a memoryview of it) exists.  If the owner
+// exports buffers, one is held so that a mutable owner can't be resized.
+struct ViewObject {
+	PyObject_HEAD
+	PyObject *owner;
+	const void *data;
+	Py_ssize_t size;
+	bool exported;
+	Py_buffer export_buffer;
+};
+
+static void view_dealloc(PyObject *object) noexcept
+{
+	auto view = reinterpret_cast<ViewObject *> (object);
+
+	if (view->exported)
+		PyBuffer_Release(&view->export_buffer);
+
+	Py_DECREF(view->owner);
+	PyObject_Del(object);
+}
+
+static int view_getbuffer(PyObject *object, Py_buffer *buffer, int flags) noexcept
+{
+	auto view = reinterpret_cast<ViewObject *> (object);
+
+	return PyBuffer_FillInfo(buffer, object, const_cast<void *> (view->data), view->size, 1, flags);
+}
+
+static PyBufferProcs view_as_buffer = {
+	view_getbuffer,                 /* bf_getbuffer */
+	nullptr,                        /* bf_releasebuffer */
+};
+
+static PyTypeObject view_type = {
+	PyVarObject_HEAD_INIT(nullptr, 0)
+	"tap.core.View",                /* tp_name */
+	sizeof (ViewObject),            /* tp_basicsize */
+	0,                              /* tp_itemsize */
+	view_dealloc,                   /* tp_dealloc */
+	0,                              /* tp_print */
+	0,                              /* tp_getattr */
+	0,                              /* tp_setattr */
+	0,                              /* tp_reserved */
+	0,                              /* tp_repr */
+	0,                              /* tp_as_number */
+	0,                              /* tp_as_sequence */
+	0,                              /* tp_as_mapping */
+	0,                              /* tp_hash  */
+	0,                              /* tp_call */
+	0,                              /* tp_str */
+	0,                              /* tp_getattro */
+	0,                              /* tp_setattro */
+	&view_as_buffer,                /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,             /* tp_flags */
+};
+
+int view_type_init() noexcept
+{
+	return PyType_Ready(&view_type);
+}
+
+PyObject *view_memoryview(PyObject *owner, const void *data, Py_ssize_t size) noexcept
+{
+	auto view = PyObject_New(ViewObject, &view_type);
+	if (view == nullptr)
+		return nullptr;
+
+	Py_INCREF(owner);
+	view->owner = owner;
+	view->data = data;
+	view->size = size;
+	view->exported = false;
+
+	if (PyObject_CheckBuffer(owner)) {
+		if (PyObject_GetBuffer(owner, &view->export_buffer, PyBUF_SIMPLE) < 0) {
+			Py_DECREF(view);
+			return nullptr;
+		}
+
+		view->exported = true;
+	}
+
+	PyObject *memoryview = PyMemoryView_FromObject(reinterpret_cast<PyObject *> (view));
+	Py_DECREF(view);
+
+	return memoryview;
+}
+
+} // namespace tap
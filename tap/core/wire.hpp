@@ -0,0 +1,411 @@
+#ifndef TAP_CORE_WIRE_HPP
+#define TAP_CORE_WIRE_HPP
+
+#include <Python.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include "portable.hpp"
+
+namespace tap {
+
+typedef int64_t Key;
+
+/*
+ * Wire format versions:
+ *
+ *   0: fixed-size little-endian fields; element counts are implied by the
+ *      record size.
+ *   1: LEB128 varints; signed values are zigzag-encoded, keys are encoded
+ *      relative to the key of the record which contains them, and element
+ *      counts are explicit.  A reference is 0 for no object, an odd key
+ *      delta, or an even immediate value.  Lists and tuples of ints or
+ *      floats may be packed as fixed-size values.
+ *   2: records are in dependency order: an object's record follows the
+ *      records of the objects it refers to, except where the references form
+ *      a cycle.  Records which can't be initialized when they are read are
+ *      flagged as deferred.
+ */
+enum {
+	WIRE_VERSION = 2,
+};
+
+// Keys with this bit set stand for immediate values (None, bools and small
+// ints) which are encoded inline in references instead of as records.
+const Key IMMEDIATE_KEY_FLAG = Key(1) << 62;
+
+inline bool key_is_immediate(Key key) noexcept
+{
+	return key >= 0 && (key & IMMEDIATE_KEY_FLAG);
+}
+
+inline uint64_t wire_zigzag(int64_t x) noexcept
+{
+	return (uint64_t(x) << 1) ^ uint64_t(x >> 63);
+}
+
+inline int64_t wire_unzigzag(uint64_t x) noexcept
+{
+	return int64_t(x >> 1) ^ -int64_t(x & 1);
+}
+
+// Upper bounds of the encoded sizes.
+inline Py_ssize_t wire_key_size(unsigned int version) noexcept
+{
+	return version ? 10 : sizeof (Key);
+}
+
+inline Py_ssize_t wire_int32_size(unsigned int version) noexcept
+{
+	return version ? 5 : sizeof (int32_t);
+}
+
+inline Py_ssize_t wire_int64_size(unsigned int version) noexcept
+{
+	return version ? 10 : sizeof (int64_t);
+}
+
+inline Py_ssize_t wire_length_size(unsigned int version) noexcept
+{
+	return version ? 10 : 0;
+}
+
+/*
+ * Encodes record contents.  The buffer must have room for the upper bound
+ * reported by the type handler's marshaled_size.
+ */
+class Writer {
+public:
+	Writer(void *buf, unsigned int version, Key base_key) noexcept:
+		begin(reinterpret_cast<uint8_t *> (buf)),
+		ptr(begin),
+		version(version),
+		base_key(base_key),
+		elide(false),
+		payload_ptr(nullptr),
+		payload_size(0),
+		payload_pos(0)
+	{
+	}
+
+	unsigned int wire_version() const noexcept
+	{
+		return version;
+	}
+
+	// Size of the encoded data, including an elided payload.
+	Py_ssize_t size() const noexcept
+	{
+		return stored_size() + payload_size;
+	}
+
+	// Size of the data written to the buffer.
+	Py_ssize_t stored_size() const noexcept
+	{
+		return ptr - begin;
+	}
+
+	// Makes payload record the memory instead of copying it.
+	void elide_payload() noexcept
+	{
+		elide = true;
+	}
+
+	const void *elided_payload(Py_ssize_t *size, Py_ssize_t *pos) const noexcept
+	{
+		*size = payload_size;
+		*pos = payload_pos;
+		return payload_ptr;
+	}
+
+	// Negative keys denote no object.
+	void key(Key key) noexcept
+	{
+		if (version == 0)
+			fixed(key);
+		else if (key < 0)
+			varint(0);
+		else if (key & IMMEDIATE_KEY_FLAG)
+			varint(uint64_t(key & ~IMMEDIATE_KEY_FLAG) << 1);
+		else
+			varint((wire_zigzag(key - base_key) << 1) | 1);
+	}
+
+	void int32(int32_t value) noexcept
+	{
+		if (version == 0)
+			fixed(value);
+		else
+			varint(wire_zigzag(value));
+	}
+
+	void int64(int64_t value) noexcept
+	{
+		if (version == 0)
+			fixed(value);
+		else
+			varint(wire_zigzag(value));
+	}
+
+	void uint8(uint8_t value) noexcept
+	{
+		*ptr++ = value;
+	}
+
+	// Fixed-size little-endian values in every version.
+	void fixed_int64(int64_t value) noexcept
+	{
+		fixed(value);
+	}
+
+	void float64(double value) noexcept
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof (bits));
+		fixed(bits);
+	}
+
+	// Element count which is implied by the record size in version 0.
+	void length(Py_ssize_t length) noexcept
+	{
+		if (version)
+			varint(length);
+	}
+
+	void data(const void *data, size_t size) noexcept
+	{
+		memcpy(ptr, data, size);
+		ptr += size;
+	}
+
+	// Returns space for size bytes which the caller fills in.
+	uint8_t *reserve(size_t size) noexcept
+	{
+		uint8_t *space = ptr;
+		ptr += size;
+		return space;
+	}
+
+	// Object memory which may be referenced instead of copied; see
+	// TypeHandler::payload.  At most one per record.
+	void payload(const void *data, size_t size) noexcept
+	{
+		if (elide) {
+			payload_ptr = data;
+			payload_size = size;
+			payload_pos = stored_size();
+		} else {
+			this->data(data, size);
+		}
+	}
+
+	void varint(uint64_t value) noexcept
+	{
+		while (value >= 0x80) {
+			*ptr++ = uint8_t(value) | 0x80;
+			value >>= 7;
+		}
+
+		*ptr++ = uint8_t(value);
+	}
+
+private:
+	template <typename T>
+	void fixed(T value) noexcept
+	{
+		value = port(value);
+		memcpy(ptr, &value, sizeof (value));
+		ptr += sizeof (value);
+	}
+
+	uint8_t *const begin;
+	uint8_t *ptr;
+	const unsigned int version;
+	const Key base_key;
+	bool elide;
+	const void *payload_ptr;
+	Py_ssize_t payload_size;
+	Py_ssize_t payload_pos;
+};
+
+/*
+ * Decodes record contents.  The accessors return false if the data is
+ * truncated or malformed.
+ */
+class Reader {
+public:
+	Reader(const void *data, Py_ssize_t size, unsigned int version, Key base_key) noexcept:
+		ptr(reinterpret_cast<const uint8_t *> (data)),
+		end(ptr + size),
+		version(version),
+		base_key(base_key)
+	{
+	}
+
+	unsigned int wire_version() const noexcept
+	{
+		return version;
+	}
+
+	Py_ssize_t remaining() const noexcept
+	{
+		return end - ptr;
+	}
+
+	bool at_end() const noexcept
+	{
+		return ptr == end;
+	}
+
+	bool key(Key *key) noexcept
+	{
+		if (version == 0)
+			return fixed(key);
+
+		uint64_t value;
+		if (!varint(&value))
+			return false;
+
+		if (value & 1) {
+			*key = base_key + wire_unzigzag(value >> 1);
+		} else if (value == 0) {
+			*key = -1;
+		} else {
+			if (Key(value >> 1) & IMMEDIATE_KEY_FLAG)
+				return false;
+
+			*key = IMMEDIATE_KEY_FLAG | Key(value >> 1);
+		}
+
+		return true;
+	}
+
+	bool int32(int32_t *value) noexcept
+	{
+		if (version == 0)
+			return fixed(value);
+
+		int64_t wide;
+		if (!int64(&wide) || wide != int32_t(wide))
+			return false;
+
+		*value = wide;
+		return true;
+	}
+
+	bool int64(int64_t *value) noexcept
+	{
+		if (version == 0)
+			return fixed(value);
+
+		uint64_t raw;
+		if (!varint(&raw))
+			return false;
+
+		*value = wire_unzigzag(raw);
+		return true;
+	}
+
+	bool uint8(uint8_t *value) noexcept
+	{
+		if (ptr == end)
+			return false;
+
+		*value = *ptr++;
+		return true;
+	}
+
+	bool fixed_int64(int64_t *value) noexcept
+	{
+		return fixed(value);
+	}
+
+	bool float64(double *value) noexcept
+	{
+		uint64_t bits;
+
+		if (!fixed(&bits))
+			return false;
+
+		memcpy(value, &bits, sizeof (bits));
+		return true;
+	}
+
+	// In version 0 the count is derived from the remaining data, which must
+	// consist of whole items of item_size bytes.
+	bool length(Py_ssize_t item_size, Py_ssize_t *length) noexcept
+	{
+		if (version == 0) {
+			if (remaining() % item_size)
+				return false;
+
+			*length = remaining() / item_size;
+			return true;
+		}
+
+		uint64_t value;
+		if (!varint(&value) || value > uint64_t(remaining()))
+			return false;
+
+		*length = value;
+		return true;
+	}
+
+	const void *data(Py_ssize_t size) noexcept
+	{
+		if (size < 0 || size > remaining())
+			return nullptr;
+
+		const void *data = ptr;
+		ptr += size;
+		return data;
+	}
+
+	bool varint(uint64_t *value) noexcept
+	{
+		uint64_t result = 0;
+
+		for (unsigned int shift = 0; shift < 64; shift += 7) {
+			if (ptr == end)
+				return false;
+
+			uint8_t byte = *ptr++;
+
+			// the tenth byte holds only the top bit
+			if (shift == 63 && byte > 1)
+				return false;
+
+			result |= uint64_t(byte & 0x7f) << shift;
+
+			if ((byte & 0x80) == 0) {
+				*value = result;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+	template <typename T>
+	bool fixed(T *value) noexcept
+	{
+		if (remaining() < Py_ssize_t(sizeof (T)))
+			return false;
+
+		memcpy(value, ptr, sizeof (T));
+		*value = port(*value);
+		ptr += sizeof (T);
+		return true;
+	}
+
+	const uint8_t *ptr;
+	const uint8_t *const end;
+	const unsigned int version;
+	const Key base_key;
+};
+
+} // namespace tap
+
+#endif
@@ -16,8 +16,9 @@ class ProtocolError(Exception):
 
 class Connection:
 
-	def __init__(self, reader, writer):
+	def __init__(self, reader, writer, view_threshold=0):
 		self._peer = core.Peer()
+		self._peer.view_threshold = view_threshold
 		self._reader = reader
 		self._writer = writer
 
@@ -65,8 +66,8 @@ def send(peer, writer, obj):
 	gc.collect()
 
 	buf = bytearray(4)
-	core.marshal(peer, buf, obj)
-	buf[:4] = struct.pack(b"<I", len(buf))
+	segments = core.marshal_segments(peer, buf, obj, core.MARSHAL_PRESIZED | core.MARSHAL_INCREMENTAL | core.MARSHAL_NEGOTIATE)
+	buf[:4] = struct.pack(b"<I", sum(len(s) for s in segments))
 
-	writer.write(buf)
+	writer.writelines(segments)
 	yield from writer.drain()
@@ -1,12 +1,16 @@
+import array
 import asyncio
+import ctypes
 import logging
 import multiprocessing
 import os
+import struct
 import sys
 
 logging.basicConfig(level=logging.DEBUG)
 
 import tap
+from tap import core
 
 log = logging.getLogger("test")
 
@@ -121,7 +125,470 @@ def generate_nothing():
 	yield 2
 	yield 3
 
+def test_bad_keys():
+	# version 0 message with a single bytes record
+	def message(key):
+		record = struct.pack("<iiq", 16 + 3, 8, key) + b"abc"
+		return struct.pack("<iiq", 16 + len(record), 0, key) + record
+
+	assert core.unmarshal(core.Peer(), message(0)) == b"abc"
+
+	for key in (0xffffffff, 1 << 32 | 0xffffffff, 1 << 40):
+		try:
+			core.unmarshal(core.Peer(), message(key))
+		except SystemError:
+			pass
+		else:
+			assert False, key
+
+# Version 0 freed section which offers a wire version.
+def version_offer(version):
+	return struct.pack("<iiq", 16, 1, -2**63 + version)
+
+def peer_pair(version):
+	local = core.Peer()
+	remote = core.Peer()
+
+	if version:
+		core.unmarshal(local, version_offer(version))
+		core.unmarshal(remote, version_offer(version))
+
+	return local, remote
+
+def loopback(sender, receiver, obj, flags=0):
+	buf = bytearray()
+	core.marshal(sender, buf, obj, flags)
+	return core.unmarshal(receiver, bytes(buf))
+
+def test_versions():
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			m = {"foo": "bar", 1: (2, 3), -7: [None]}
+			l = [0, -5, 2**40, 0.5, None, True, False, "x" * 100, b"y", m, [1, 2, 3], (0.5, 1.5)]
+			l.append(l)
+
+			buf = bytearray()
+			core.marshal(local, buf, l, flags)
+			assert struct.unpack_from("<ii", buf)[1] >> 8 == version
+
+			r = core.unmarshal(remote, bytes(buf))
+			assert r[-1] is r and r[:-1] == l[:-1], (version, flags, r)
+			assert loopback(remote, local, r, flags) is l
+
+			m["foo"] = "baz"
+			l[10].append(4)
+			l[10][0] = 5
+			assert loopback(local, remote, l, flags) is r
+			assert r[9] == m and r[10] == [5, 2, 3, 4], (version, flags, r)
+
+def test_negotiation():
+	local = core.Peer()
+	remote = core.Peer()
+
+	buf = bytearray()
+	core.marshal(local, buf, None, core.MARSHAL_NEGOTIATE)
+	assert bytes(buf[:16]) == version_offer(core.WIRE_VERSION)
+	core.unmarshal(remote, bytes(buf))
+
+	loopback(remote, local, None, core.MARSHAL_NEGOTIATE)
+
+	for sender, receiver in [(local, remote), (remote, local)]:
+		buf = bytearray()
+		core.marshal(sender, buf, [1], core.MARSHAL_NEGOTIATE)
+		assert struct.unpack_from("<ii", buf)[1] >> 8 == core.WIRE_VERSION
+		assert core.unmarshal(receiver, bytes(buf)) == [1]
+
+	# a varint's tenth byte holds only the top bit
+	for last, valid in [(1, True), (2, False)]:
+		keys = b"\xfe" + b"\xff" * 8 + bytes([last])
+		message = struct.pack("<ii", 8 + len(keys), 1 << 8 | 1) + keys
+
+		try:
+			core.unmarshal(core.Peer(), message)
+		except SystemError:
+			assert not valid
+		else:
+			assert valid
+
+def test_buffers():
+	for version in range(core.WIRE_VERSION + 1):
+		local, remote = peer_pair(version)
+
+		b = bytearray(b"abc")
+		a = array.array("d", [0.5, 1.5])
+		m = memoryview(bytearray(range(12))).cast("i", (3,))
+		obj = [b, a, m, memoryview(b"xyz")]
+
+		r = loopback(local, remote, obj)
+		assert type(r[0]) is bytearray and r[0] == b, (version, r)
+		assert type(r[1]) is array.array and r[1] == a, (version, r)
+		assert r[2].format == "i" and r[2].tolist() == m.tolist(), (version, r)
+		assert r[3].readonly and r[3] == b"xyz", (version, r)
+
+		b[0] = ord("z")
+		a[1] = 2.5
+		m[2] = 7
+		assert loopback(local, remote, obj) is r
+		assert r[0] == b and r[1] == a and r[2].tolist() == m.tolist(), (version, r)
+
+	# formats which memoryviews can't be cast to are sent as bytes
+	class Wide(ctypes.Structure):
+		_fields_ = [("f{}".format(i), ctypes.c_int) for i in range(100)]
+
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED):
+			local, remote = peer_pair(version)
+
+			c = (ctypes.c_int * 3)(1, 2, 3)
+			w = Wide()
+			w.f99 = 7
+			obj = [memoryview(c), memoryview(w), memoryview(c).cast("B").cast("I", (3, 1))]
+
+			r = loopback(local, remote, obj, flags)
+			assert [m.format for m in r] == ["B", "B", "I"], (version, flags, r)
+			assert r[0].tobytes() == bytes(c) and r[1].tobytes() == bytes(w), (version, flags, r)
+			assert r[2].tolist() == [[1], [2], [3]], (version, flags, r)
+			assert loopback(remote, local, r, flags) is obj
+
+def test_segments():
+	for version in range(core.WIRE_VERSION + 1):
+		flags = core.MARSHAL_PRESIZED | core.MARSHAL_INCREMENTAL
+		local, remote = peer_pair(version)
+
+		big = b"x" * 5000
+		small = "y" * 100
+		obj = [big, small, None]
+
+		segments = core.marshal_segments(local, bytearray(), obj, flags)
+		assert [s for s in segments if s == big], (version, segments)
+		assert not [s for s in segments if s == small.encode()], (version, segments)
+
+		r = core.unmarshal(remote, b"".join(segments))
+		assert r == obj, (version, r)
+
+		obj[2] = "z" * 5000
+
+		segments = core.marshal_segments(local, bytearray(), obj, flags, 1000)
+		assert not [s for s in segments if s == big], (version, segments)
+		assert [s for s in segments if s == obj[2].encode()], (version, segments)
+
+		assert core.unmarshal(remote, b"".join(segments)) is r
+		assert r == obj, (version, r)
+
+def test_marshal_into():
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			obj = [1, "two", [3.0], {4: b"five"}]
+
+			buf = bytearray(16)
+			size = core.marshal_into(local, buf, 0, obj, flags)
+			assert size > len(buf), (version, flags, size)
+
+			buf = bytearray(b"abc" + bytes(size))
+			n = core.marshal_into(local, buf, 3, obj, flags)
+			assert 0 < n <= size and buf[:3] == b"abc", (version, flags, n)
+
+			r = core.unmarshal(remote, bytes(buf[3:3 + n]))
+			assert r == obj, (version, flags, r)
+
+			obj[2][0] = 6.0
+			buf = bytearray(size)
+			n = core.marshal_into(local, buf, 0, obj, flags)
+			assert core.unmarshal(remote, bytes(buf[:n])) is r
+			assert r == obj, (version, flags, r)
+
+	try:
+		core.marshal_into(core.Peer(), bytearray(4), 5, None)
+	except ValueError:
+		pass
+	else:
+		assert False
+
+def test_views():
+	for version in range(core.WIRE_VERSION + 1):
+		for threshold in (0, 1000):
+			local, remote = peer_pair(version)
+			assert remote.view_threshold == 0
+			remote.view_threshold = threshold
+
+			obj = [b"x" * 1000, b"y" * 999]
+
+			buf = bytearray()
+			core.marshal(local, buf, obj)
+			message = bytes(buf)
+			refs = sys.getrefcount(message)
+
+			r = core.unmarshal(remote, message)
+			assert r[1] == obj[1] and type(r[1]) is bytes, (version, threshold, r)
+
+			if threshold:
+				assert type(r[0]) is memoryview and r[0].readonly, (version, threshold, r)
+				assert r[0] == obj[0] and sys.getrefcount(message) > refs, (version, threshold, r)
+			else:
+				assert type(r[0]) is bytes and r[0] == obj[0], (version, threshold, r)
+				assert sys.getrefcount(message) == refs
+
+			view = r[0]
+			del r, message
+			assert view == obj[0]
+
+	peer = core.Peer()
+
+	for value, error in [(-1, ValueError), ("1", TypeError)]:
+		try:
+			peer.view_threshold = value
+		except error:
+			pass
+		else:
+			assert False
+
+	try:
+		del peer.view_threshold
+	except AttributeError:
+		pass
+	else:
+		assert False
+
+# Unmarshals a string record whose UTF-8 data (at the end of the message) has
+# been replaced.
+def unmarshal_text(data):
+	placeholder = "#" * len(data)
+
+	buf = bytearray()
+	core.marshal(core.Peer(), buf, placeholder)
+	assert buf.endswith(placeholder.encode())
+	buf[len(buf) - len(data):] = data
+
+	return core.unmarshal(core.Peer(), bytes(buf))
+
+def test_utf8():
+	prefixes = [0, 1, 15, 16, 31, 32, 33, 100]
+
+	for n in prefixes:
+		for c in ["\x7f", "\x80", "\xe9", "\u07ff", "\u0800", "\u20ac", "\ufffd", "\uffff", "\U00010000", "\U0001d11e", "\U0010ffff"]:
+			text = "a" * n + c + "b" + c * 20
+			assert unmarshal_text(text.encode()) == text, (n, c)
+
+	bad = [
+		b"\x80", b"\xbf", b"\xff", b"\xfe",
+		b"\xc0\x80", b"\xc1\xbf", b"\xe0\x80\x80", b"\xe0\x9f\xbf", b"\xf0\x80\x80\x80", b"\xf0\x8f\xbf\xbf",
+		b"\xed\xa0\x80", b"\xed\xbf\xbf",
+		b"\xf4\x90\x80\x80", b"\xf5\x80\x80\x80", b"\xf7\xbf\xbf\xbf",
+		b"\xc3\x28", b"\xe2\x28\xa1", b"\xe2\x82\x28", b"\xf0\x9d\x84\x28",
+	]
+
+	for n in prefixes:
+		for data in bad:
+			for suffix in [b"", b"b" * 40]:
+				try:
+					unmarshal_text(b"a" * n + data + suffix)
+				except SystemError:
+					pass
+				else:
+					assert False, (n, data, suffix)
+
+	# sequences cut off at the end of the data, at block edges
+	for edge in [16, 32, 64]:
+		for c in ["\xe9", "\u20ac", "\U0001d11e"]:
+			encoded = c.encode()
+
+			for cut in range(1, len(encoded)):
+				for data in [b"a" * (edge - cut) + encoded[:cut], b"a" * (edge - 1) + encoded[:cut] + b"b" * 40]:
+					try:
+						unmarshal_text(data)
+					except SystemError:
+						pass
+					else:
+						assert False, (edge, c, cut, data)
+
+def test_builtins():
+	import math
+	import types
+
+	assert loopback(core.Peer(), core.Peer(), math.sqrt) is math.sqrt
+	assert loopback(core.Peer(), core.Peer(), [math.sqrt, math.floor]) == [math.sqrt, math.floor]
+
+	fake = types.ModuleType("math")
+	fake.sqrt = len
+	sys.modules["math"] = fake
+
+	try:
+		assert loopback(core.Peer(), core.Peer(), math.sqrt) is len
+	finally:
+		sys.modules["math"] = math
+
+	assert loopback(core.Peer(), core.Peer(), math.sqrt) is math.sqrt
+
+class CoreAPI(ctypes.Structure):
+	_fields_ = [
+		("version", ctypes.c_int),
+		("register_type", ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.c_void_p)),
+		("key_for_remote", ctypes.c_void_p),
+		("object", ctypes.c_void_p),
+		("touch", ctypes.c_void_p),
+	]
+
+class TypeHandler(ctypes.Structure):
+	_fields_ = [("type_id", ctypes.c_int32)] + [(name, ctypes.c_void_p) for name in [
+		"traverse", "marshaled_size", "marshal", "unmarshal_alloc",
+		"unmarshal_init", "unmarshal_update", "payload", "by_value",
+	]]
+
+# registered for good, so never marshaled
+class Registered:
+	pass
+
+registered_handler = TypeHandler(0x100)
+
+def test_api():
+	get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+	get_pointer.restype = ctypes.c_void_p
+	get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+
+	api = CoreAPI.from_address(get_pointer(core._api, b"tap.core._api"))
+	assert api.version == 1
+
+	handler = ctypes.addressof(registered_handler)
+	refs = sys.getrefcount(Registered)
+
+	assert api.register_type(Registered, handler) == 0
+	assert sys.getrefcount(Registered) == refs + 1
+
+	for type_id, cls in [(0x100, Registered), (0x100, type("Other", (), {})), (0xff, type("Low", (), {}))]:
+		other = TypeHandler(type_id)
+
+		try:
+			api.register_type(cls, ctypes.addressof(other))
+		except ValueError:
+			pass
+		else:
+			assert False, (type_id, cls)
+
+def test_failed_marshal():
+	Unnamed = type("Unnamed", (), {"__module__": None})
+
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			l = [1, None]
+			r = loopback(local, remote, l, flags)
+
+			shared = [2, 3]
+			l[1] = shared
+
+			try:
+				loopback(local, remote, [l, Unnamed()], flags)
+			except SystemError:
+				pass
+			else:
+				assert False
+
+			assert loopback(local, remote, l, flags) is r
+			assert r == [1, [2, 3]], (version, flags, r)
+			assert loopback(local, remote, [shared], flags)[0] is r[1]
+
+class Point:
+	def __init__(self, x):
+		self.x = x
+
+	def __hash__(self):
+		return hash(self.x)
+
+	def __eq__(self, other):
+		return isinstance(other, Point) and other.x == self.x
+
+class OtherPoint(Point):
+	pass
+
+class Slotted:
+	__slots__ = ["a", "b"]
+
+	def __init__(self, a, b):
+		self.a = a
+		self.b = b
+
+def test_instances():
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			p = Point(1)
+			s = Slotted(2, [3])
+			m = {Point(4): "v", frozenset({Point(5)}): [Point(6)]}
+			o = Point(7)
+			f = frozenset({o, 8})
+			o.f = f
+			obj = [p, s, m, f, o]
+
+			r = loopback(local, remote, obj, flags)
+			assert type(r[0]) is Point and r[0].x == 1, (version, flags, r)
+			assert type(r[1]) is Slotted and r[1].a == 2 and r[1].b == [3], (version, flags, r)
+			assert r[2] == m and r[3] == f and r[4].f is r[3], (version, flags, r)
+			assert loopback(remote, local, r, flags) is obj
+
+			p.x = 10
+			p.__class__ = OtherPoint
+			s.a = 5
+			assert loopback(local, remote, obj, flags) is r
+			assert type(r[0]) is OtherPoint and r[0].x == 10 and r[1].a == 5, (version, flags, r)
+
+def test_ints():
+	ints = [0, 1, -1, 2**31, 2**62, 2**63 - 1, -2**63, 2**63, -2**63 - 1, 2**64, 2**100, -2**200, 3**1000]
+
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			r = loopback(local, remote, ints, flags)
+			assert r == ints and all(type(i) is int for i in r), (version, flags, r)
+			assert loopback(remote, local, r, flags) is ints
+
+def test_sets():
+	for version in range(core.WIRE_VERSION + 1):
+		for flags in (0, core.MARSHAL_PRESIZED, core.MARSHAL_INCREMENTAL):
+			local, remote = peer_pair(version)
+
+			b = frozenset({1, 2})
+			a = frozenset({b, (b, 3)})
+			s = set(range(20))
+			obj = [(b, frozenset({b})), a, {b: a}, s, {frozenset()}]
+
+			r = loopback(local, remote, obj, flags)
+			assert r == obj and hash(r[1]) == hash(a), (version, flags, r)
+			assert r[0][0] is next(iter(r[0][1])), (version, flags, r)
+			assert type(r[3]) is set and type(r[1]) is frozenset, (version, flags, r)
+			assert loopback(remote, local, r, flags) is obj
+
+			s.discard(0)
+			s.add(b)
+			s |= {"x"}
+			assert loopback(local, remote, obj, flags) is r
+			assert r[3] == s and b in r[3], (version, flags, r)
+
+def test_local():
+	test_bad_keys()
+	test_versions()
+	test_negotiation()
+	test_buffers()
+	test_segments()
+	test_marshal_into()
+	test_views()
+	test_utf8()
+	test_builtins()
+	test_api()
+	test_failed_marshal()
+	test_ints()
+	test_sets()
+	test_instances()
+
 def main():
+	test_local()
+
 	procs = []
 
 	for target, name in [(test_server, "server"), (test_client, "client")]: